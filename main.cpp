@@ -2,420 +2,5655 @@
 // @ruiesteves August 2024
 
 #include <SFML/Graphics.hpp>
+#include <SFML/OpenGL.hpp>
 #include <vector>
 #include <algorithm>
 #include <random>
 #include <chrono>
 #include <thread>
 #include <cmath>
-#include <map>
+#include <cstdint>
+#include <charconv>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <ctime>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cctype>
+#include <memory>
+#include <iterator>
+#include <type_traits>
+#include <string_view>
+#include <new>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 // Constants
 const int WINDOW_WIDTH = 800;
 const int WINDOW_HEIGHT = 600;
 
-enum SortAlgorithm {BUBBLE_SORT, HEAP_SORT, QUICK_SORT, MERGE_SORT, SELECTION_SORT};
+enum SortAlgorithm {BUBBLE_SORT, HEAP_SORT, QUICK_SORT, MERGE_SORT, SELECTION_SORT, PARALLEL_MERGE_SORT, PARALLEL_QUICK_SORT, BOTTOM_UP_MERGE_SORT, INTRO_SORT,
+                    RADIX_SORT_LSD_8, RADIX_SORT_LSD_11, RADIX_SORT_LSD_16, RADIX_SORT_MSD, COUNTING_SORT,
+                    TIM_SORT};
+
+// Util functions (mainly display)
+sf::Color getColor(int value) {
+    unsigned v = value; // wraps instead of overflowing for large values
+    int r = (v * 23) % 256;
+    int g = (v * 59) % 256;
+    int b = (v * 97) % 256;
+    return sf::Color(r, g, b);
+}
+
+// Instrumentation counters: every operator new in the process, and every draw call made by
+// the render thread. The overlay shows how much they grow per frame.
+std::atomic<std::uint64_t> allocationCount{0};
+std::uint64_t drawCallCount = 0;
+
+// Kept out of line: once inlined next to each other, GCC reports the free() as mismatched
+[[gnu::noinline]] void *operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size > 0 ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void *memory) noexcept { std::free(memory); }
+[[gnu::noinline]] void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+
+void countedDraw(sf::RenderTarget &target, const sf::Drawable &drawable, const sf::RenderStates &states = sf::RenderStates::Default) {
+    drawCallCount++;
+    target.draw(drawable, states);
+}
+
+// Highlight colours for the current frame, one slot per array index.
+// Renderers index it directly. The indices set this frame, and the ones set the frame
+// before, are kept in short lists so clearing and redrawing only cost what changed.
+class HighlightBuffer {
+public:
+    void resize(size_t size) {
+        colors.assign(size, sf::Color::Transparent);
+        current.clear();
+        previous.clear();
+    }
+
+    void set(int index, const sf::Color &color) {
+        if (!isSet(index))
+            current.push_back(index);
+        colors[index] = color;
+    }
+
+    // Starts a new frame: forgets this frame's highlights but remembers where they were
+    void clear() {
+        for (int index : current)
+            colors[index] = sf::Color::Transparent;
+        previous.swap(current);
+        current.clear();
+    }
+
+    size_t size() const { return colors.size(); }
+    bool isSet(int index) const { return colors[index].a != 0; }
+    const sf::Color &operator[](int index) const { return colors[index]; }
+    const std::vector<int> &getCurrent() const { return current; }
+    const std::vector<int> &getPrevious() const { return previous; }
+
+private:
+    std::vector<sf::Color> colors;
+    std::vector<int> current;
+    std::vector<int> previous;
+};
+
+// Draws all bars of the array with a single draw call.
+// Keeps one quad per bar in a persistent vertex array and only rewrites the quads whose
+// value or highlight changed since the last frame. When there are more bars than pixel
+// columns, each column shows the tallest bar of the indices it covers. Heights are scaled
+// so the largest value reaches maxHeight.
+class BarRenderer {
+public:
+    BarRenderer(float baseline, float maxHeight) : baseline(baseline), maxHeight(maxHeight) {}
+
+    void update(const std::vector<int> &array, const std::vector<int> &touched, bool allTouched, const HighlightBuffer &highlights) {
+        if (allTouched || array.size() != barCount) {
+            layout(array);
+        } else {
+            for (int index : touched)
+                markDirty(columnOf(index));
+            for (int index : highlights.getPrevious())
+                markDirty(columnOf(index));
+            for (int index : highlights.getCurrent())
+                markDirty(columnOf(index));
+        }
+
+        for (size_t column : dirtyColumns) {
+            updateColumn(column, array, highlights);
+            dirty[column] = false;
+        }
+        dirtyColumns.clear();
+    }
+
+    void draw(sf::RenderTarget &target) const {
+        countedDraw(target, vertices);
+    }
+
+    // Underlines each [first, last] run with a strip just below the bars, alternating two
+    // colours so that neighbouring runs stay apart. Uses the layout of the last update().
+    void drawRuns(sf::RenderTarget &target, const std::vector<std::pair<int, int>> &runs) {
+        runVertices.setPrimitiveType(sf::Quads);
+        runVertices.resize(runs.size() * 4);
+        for (size_t i = 0; i < runs.size(); ++i) {
+            float left = startX + columnOf(runs[i].first) * slotWidth;
+            float right = startX + (columnOf(runs[i].second) + 1) * slotWidth - spacing;
+            sf::Color color = i % 2 == 0 ? sf::Color(60, 160, 255) : sf::Color(255, 170, 40);
+            sf::Vertex *quad = &runVertices[i * 4];
+            quad[0].position = sf::Vector2f(left, baseline + 6);
+            quad[1].position = sf::Vector2f(right, baseline + 6);
+            quad[2].position = sf::Vector2f(right, baseline + 12);
+            quad[3].position = sf::Vector2f(left, baseline + 12);
+            for (int corner = 0; corner < 4; ++corner)
+                quad[corner].color = color;
+        }
+        countedDraw(target, runVertices);
+    }
+
+private:
+    void layout(const std::vector<int> &array) {
+        size_t count = array.size();
+        barCount = count;
+        int largest = count > 0 ? std::max(1, *std::max_element(array.begin(), array.end())) : 1;
+        scale = maxHeight / largest;
+        columns = std::min<size_t>(count, WINDOW_WIDTH);
+        slotWidth = columns > 0 ? std::min(12.0f, (float)WINDOW_WIDTH / columns) : 0.0f;
+        spacing = slotWidth >= 4.0f ? slotWidth / 6.0f : 0.0f;
+        startX = (WINDOW_WIDTH - columns * slotWidth + spacing) / 2;
+
+        vertices.setPrimitiveType(sf::Quads);
+        vertices.resize(columns * 4);
+        dirty.assign(columns, true);
+        dirtyColumns.resize(columns);
+        for (size_t column = 0; column < columns; ++column)
+            dirtyColumns[column] = column;
+    }
+
+    size_t columnOf(int index) const {
+        return (size_t)index * columns / barCount;
+    }
+
+    size_t firstIndexOf(size_t column) const {
+        return (column * barCount + columns - 1) / columns;
+    }
+
+    void markDirty(size_t column) {
+        if (column < columns && !dirty[column]) {
+            dirty[column] = true;
+            dirtyColumns.push_back(column);
+        }
+    }
+
+    void updateColumn(size_t column, const std::vector<int> &array, const HighlightBuffer &highlights) {
+        size_t first = firstIndexOf(column);
+        size_t last = firstIndexOf(column + 1);
+
+        int height = array[first];
+        sf::Color color = highlights.isSet(first) ? highlights[first] : sf::Color::White;
+        for (size_t i = first + 1; i < last; ++i) {
+            height = std::max(height, array[i]);
+            if (highlights.isSet(i))
+                color = highlights[i];
+        }
+
+        float left = startX + column * slotWidth;
+        float right = left + slotWidth - spacing;
+        float top = baseline - std::max(0, height) * scale;
+        sf::Vertex *quad = &vertices[column * 4];
+        quad[0].position = sf::Vector2f(left, top);
+        quad[1].position = sf::Vector2f(right, top);
+        quad[2].position = sf::Vector2f(right, baseline);
+        quad[3].position = sf::Vector2f(left, baseline);
+        for (int corner = 0; corner < 4; ++corner)
+            quad[corner].color = color;
+    }
+
+    float baseline;
+    float maxHeight;
+    float scale = 1.0f;
+    float slotWidth = 0.0f;
+    float spacing = 0.0f;
+    float startX = 0.0f;
+    size_t barCount = 0;
+    size_t columns = 0;
+    sf::VertexArray vertices;
+    sf::VertexArray runVertices;
+    std::vector<bool> dirty;
+    std::vector<size_t> dirtyColumns;
+};
+
+// The digits and the minus sign of one font size, looked up once, so that numbers can be
+// drawn as textured quads inside a vertex array instead of one sf::Text each
+class DigitGlyphs {
+public:
+    static constexpr int MAX_CHARS = 11; // "-2147483648"
+
+    DigitGlyphs(const sf::Font &font, unsigned characterSize) : font(font), characterSize(characterSize) {
+        const char characters[] = "0123456789-";
+        for (int c = 0; c < GLYPH_COUNT; ++c) {
+            const sf::Glyph &glyph = font.getGlyph(characters[c], characterSize, false);
+            glyphs[c].bounds = glyph.bounds;
+            glyphs[c].texture = sf::FloatRect(glyph.textureRect.left, glyph.textureRect.top, glyph.textureRect.width, glyph.textureRect.height);
+            glyphs[c].advance = glyph.advance;
+        }
+    }
+
+    // Fills the MAX_CHARS quads at quads with value, written from x on (or centred on x).
+    // Unused quads are emptied, and so are all of them when the number is wider than maxWidth.
+    void build(sf::Vertex *quads, int value, float x, float baselineY, float maxWidth, bool centered) const {
+        char digits[MAX_CHARS + 1];
+        char *end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        int length = end - digits;
+
+        float width = 0.0f;
+        for (int c = 0; c < length; ++c)
+            width += glyphs[glyphIndex(digits[c])].advance;
+        if (width > maxWidth)
+            length = 0;
+
+        float penX = centered ? x - width / 2 : x;
+        for (int c = 0; c < MAX_CHARS; ++c) {
+            sf::Vertex *glyphQuad = &quads[c * 4];
+            if (c >= length) {
+                for (int corner = 0; corner < 4; ++corner)
+                    glyphQuad[corner] = sf::Vertex();
+                continue;
+            }
+            const GlyphQuad &glyph = glyphs[glyphIndex(digits[c])];
+            float left = penX + glyph.bounds.left;
+            float right = left + glyph.bounds.width;
+            float upper = baselineY + glyph.bounds.top;
+            float lower = upper + glyph.bounds.height;
+            float u0 = glyph.texture.left;
+            float u1 = u0 + glyph.texture.width;
+            float v0 = glyph.texture.top;
+            float v1 = v0 + glyph.texture.height;
+            glyphQuad[0] = sf::Vertex(sf::Vector2f(left, upper), sf::Color::Black, sf::Vector2f(u0, v0));
+            glyphQuad[1] = sf::Vertex(sf::Vector2f(right, upper), sf::Color::Black, sf::Vector2f(u1, v0));
+            glyphQuad[2] = sf::Vertex(sf::Vector2f(right, lower), sf::Color::Black, sf::Vector2f(u1, v1));
+            glyphQuad[3] = sf::Vertex(sf::Vector2f(left, lower), sf::Color::Black, sf::Vector2f(u0, v1));
+            penX += glyph.advance;
+        }
+    }
+
+    const sf::Texture &getTexture() const { return font.getTexture(characterSize); }
+
+private:
+    static constexpr int GLYPH_COUNT = 11;
+
+    struct GlyphQuad {
+        sf::FloatRect bounds;
+        sf::FloatRect texture;
+        float advance;
+    };
+
+    static int glyphIndex(char c) {
+        return c == '-' ? 10 : c - '0';
+    }
+
+    const sf::Font &font;
+    unsigned characterSize;
+    GlyphQuad glyphs[GLYPH_COUNT];
+};
+
+// Draws the array strip below the bars: one cell per element with its value written on it.
+// The digit glyphs are looked up in the font once, so labels are plain textured quads that
+// are only rebuilt when their value changes. Cells outside the window are never built, and
+// labels that do not fit in their cell are left out.
+class LabelLayer {
+public:
+    LabelLayer(const sf::Font &font, float top) : digits(font, CHARACTER_SIZE), top(top) {}
+
+    // highlights may be null when the cells are never highlighted
+    void update(const std::vector<int> &array, const std::vector<int> &touched, bool allTouched, const HighlightBuffer *highlights, bool colorByValue) {
+        if (allTouched || array.size() != cellCount || colorByValue != valueColors) {
+            valueColors = colorByValue;
+            layout(array.size());
+            for (size_t i = firstVisible; i < lastVisible; ++i)
+                buildCell(i, array, highlights);
+        } else {
+            for (int index : touched)
+                rebuildCell(index, array, highlights);
+            if (highlights) {
+                for (int index : highlights->getPrevious())
+                    rebuildCell(index, array, highlights);
+                for (int index : highlights->getCurrent())
+                    rebuildCell(index, array, highlights);
+            }
+        }
+    }
+
+    void draw(sf::RenderTarget &target) const {
+        countedDraw(target, cells);
+        countedDraw(target, labels, sf::RenderStates(&digits.getTexture()));
+    }
+
+private:
+    static constexpr unsigned CHARACTER_SIZE = 14;
+    static constexpr float CELL_SIZE = 30.0f;
+    static constexpr int MAX_CHARS = DigitGlyphs::MAX_CHARS;
+
+    void layout(size_t count) {
+        cellCount = count;
+        startX = (WINDOW_WIDTH - count * (double)CELL_SIZE) / 2;
+        firstVisible = startX < 0 ? std::min<size_t>(count, (size_t)(-startX / CELL_SIZE)) : 0;
+        lastVisible = std::min<size_t>(count, (size_t)std::ceil((WINDOW_WIDTH - startX) / CELL_SIZE));
+        lastVisible = std::max(lastVisible, firstVisible);
+
+        size_t visible = lastVisible - firstVisible;
+        cells.setPrimitiveType(sf::Quads);
+        cells.resize(visible * 4);
+        labels.setPrimitiveType(sf::Quads);
+        labels.resize(visible * MAX_CHARS * 4);
+    }
+
+    void rebuildCell(int index, const std::vector<int> &array, const HighlightBuffer *highlights) {
+        if ((size_t)index >= firstVisible && (size_t)index < lastVisible)
+            buildCell(index, array, highlights);
+    }
+
+    void buildCell(size_t index, const std::vector<int> &array, const HighlightBuffer *highlights) {
+        size_t slot = index - firstVisible;
+        float x = (float)(startX + index * (double)CELL_SIZE);
+
+        sf::Color color = valueColors ? getColor(array[index]) : sf::Color::White;
+        if (highlights && highlights->isSet(index))
+            color = (*highlights)[index];
+
+        // Leave a 2px black gap on the right, like the old outlined squares
+        sf::Vertex *quad = &cells[slot * 4];
+        quad[0] = sf::Vertex(sf::Vector2f(x, top), color);
+        quad[1] = sf::Vertex(sf::Vector2f(x + CELL_SIZE - 2, top), color);
+        quad[2] = sf::Vertex(sf::Vector2f(x + CELL_SIZE - 2, top + CELL_SIZE), color);
+        quad[3] = sf::Vertex(sf::Vector2f(x, top + CELL_SIZE), color);
+
+        digits.build(&labels[slot * MAX_CHARS * 4], array[index], x + 5, top + 5 + CHARACTER_SIZE, CELL_SIZE - 7, false);
+    }
+
+    DigitGlyphs digits;
+    float top;
+    bool valueColors = false;
+    double startX = 0.0; // a float is off by whole cells this far left of a 10M element strip
+    size_t cellCount = 0;
+    size_t firstVisible = 0;
+    size_t lastVisible = 0;
+    sf::VertexArray cells;
+    sf::VertexArray labels;
+};
+
+// Draws the heap as a tree. The layout only depends on the array size and the arity, so it
+// is computed once for both: every level gets a row, and the arity^level slots of a level
+// share the window width. Nodes, edges and labels each live in one vertex array, and only
+// the nodes whose key changed are rewritten. Levels whose slots are narrower than
+// MIN_SLOT_WIDTH collapse into a strip of one pixel columns, coloured after the largest key
+// each column covers. Keys past the heap size (the sorted tail) are hidden.
+class HeapRenderer {
+public:
+    HeapRenderer(const sf::Font &font, float top, float bottom) : digits(font, CHARACTER_SIZE), top(top), bottom(bottom) {}
+
+    void update(const std::vector<int> &array, const std::vector<int> &touched, bool allTouched, int heapSize, int arity) {
+        size_t shown = std::min<size_t>(std::max(heapSize, 0), array.size());
+        if (allTouched || array.size() != nodeCount || arity != heapArity) {
+            layout(array.size(), arity);
+            shownCount = shown;
+            for (size_t i = 0; i < nodeLevel.size(); ++i)
+                buildNode(i, array);
+            for (size_t level = 0; level < levels.size(); ++level)
+                for (size_t column = 0; column < levels[level].columns; ++column)
+                    buildColumn(level, column, array);
+            return;
+        }
+
+        for (int index : touched)
+            markDirty(index);
+        for (size_t i = std::min(shown, shownCount); i < std::max(shown, shownCount); ++i)
+            markDirty(i);
+        shownCount = shown;
+
+        for (size_t node : dirtyNodes) {
+            buildNode(node, array);
+            nodeDirty[node] = false;
+        }
+        dirtyNodes.clear();
+        for (const std::pair<size_t, size_t> &column : dirtyColumns) {
+            buildColumn(column.first, column.second, array);
+            columnDirty[levels[column.first].columnOffset + column.second] = false;
+        }
+        dirtyColumns.clear();
+    }
+
+    void draw(sf::RenderTarget &target) const {
+        countedDraw(target, edges);
+        countedDraw(target, nodes);
+        countedDraw(target, labels, sf::RenderStates(&digits.getTexture()));
+    }
+
+private:
+    static constexpr unsigned CHARACTER_SIZE = 12;
+    static constexpr float MIN_SLOT_WIDTH = 4.0f;
+    static constexpr float MAX_NODE_SIZE = 36.0f;
+    static constexpr float MIN_LABEL_NODE_SIZE = 22.0f;
+    static constexpr float MAX_ROW_HEIGHT = 60.0f;
+    static constexpr int MAX_CHARS = DigitGlyphs::MAX_CHARS;
+
+    struct Level {
+        size_t first; // index of the first node
+        size_t count; // nodes in the level, only the last one can be partly filled
+        std::uint64_t slots; // arity^level
+        float y; // top of the row
+        float nodeSize;
+        size_t fullColumns; // columns a full collapsed level would have: one per slot, at most one per pixel
+        size_t columns; // columns of a collapsed level, 0 when its nodes are drawn one by one
+        size_t columnOffset; // columns of the collapsed levels above this one
+    };
+
+    void layout(size_t count, int arity) {
+        nodeCount = count;
+        heapArity = arity;
+        levels.clear();
+        for (std::uint64_t first = 0, slots = 1; first < count; first += slots, slots *= arity)
+            levels.push_back({first, std::min<size_t>(slots, count - first), slots, 0.0f, 0.0f, 0, 0, 0});
+
+        float rowHeight = levels.empty() ? 0.0f : std::min(MAX_ROW_HEIGHT, (bottom - top) / levels.size());
+        size_t drawnNodes = 0, labelledNodes = 0, columnCount = 0;
+        for (size_t l = 0; l < levels.size(); ++l) {
+            Level &level = levels[l];
+            float slotWidth = (float)WINDOW_WIDTH / level.slots;
+            level.y = top + l * rowHeight;
+            level.nodeSize = std::min({slotWidth - 2.0f, rowHeight * 0.6f, MAX_NODE_SIZE});
+            if (slotWidth >= MIN_SLOT_WIDTH) {
+                drawnNodes = level.first + level.count;
+                if (level.nodeSize >= MIN_LABEL_NODE_SIZE)
+                    labelledNodes = drawnNodes;
+            } else {
+                level.nodeSize = std::max(1.0f, rowHeight * 0.6f);
+                level.fullColumns = std::min<std::uint64_t>(level.slots, WINDOW_WIDTH);
+                level.columns = (level.count * level.fullColumns + level.slots - 1) / level.slots;
+                level.columnOffset = columnCount;
+                columnCount += level.columns;
+            }
+        }
+
+        nodeLevel.resize(drawnNodes);
+        for (size_t l = 0; l < levels.size(); ++l)
+            for (size_t k = 0; k < levels[l].count && levels[l].columns == 0; ++k)
+                nodeLevel[levels[l].first + k] = l;
+        labelCount = labelledNodes;
+
+        nodes.setPrimitiveType(sf::Quads);
+        nodes.resize((drawnNodes + columnCount) * 4);
+        edges.setPrimitiveType(sf::Lines);
+        edges.resize(drawnNodes > 1 ? (drawnNodes - 1) * 2 : 0);
+        labels.setPrimitiveType(sf::Quads);
+        labels.resize(labelCount * MAX_CHARS * 4);
+        nodeDirty.assign(drawnNodes, false);
+        columnDirty.assign(columnCount, false);
+        dirtyNodes.clear();
+        dirtyColumns.clear();
+    }
+
+    sf::Vector2f centerOf(size_t node) const {
+        const Level &level = levels[nodeLevel[node]];
+        float x = (node - level.first + 0.5f) * WINDOW_WIDTH / level.slots;
+        return sf::Vector2f(x, level.y + level.nodeSize / 2);
+    }
+
+    void markDirty(size_t index) {
+        if (index >= nodeCount)
+            return;
+        if (index < nodeLevel.size()) {
+            if (!nodeDirty[index]) {
+                nodeDirty[index] = true;
+                dirtyNodes.push_back(index);
+            }
+            return;
+        }
+        size_t level = nodeLevel.empty() ? 0 : nodeLevel.back();
+        while (index >= levels[level].first + levels[level].count)
+            level++;
+        size_t column = (index - levels[level].first) * levels[level].fullColumns / levels[level].slots;
+        if (!columnDirty[levels[level].columnOffset + column]) {
+            columnDirty[levels[level].columnOffset + column] = true;
+            dirtyColumns.push_back({level, column});
+        }
+    }
+
+    void buildNode(size_t node, const std::vector<int> &array) {
+        bool shown = node < shownCount;
+        sf::Color color = shown ? getColor(array[node]) : sf::Color::Transparent;
+        float half = levels[nodeLevel[node]].nodeSize / 2;
+        sf::Vector2f center = centerOf(node);
+
+        sf::Vertex *quad = &nodes[node * 4];
+        quad[0] = sf::Vertex(sf::Vector2f(center.x - half, center.y - half), color);
+        quad[1] = sf::Vertex(sf::Vector2f(center.x + half, center.y - half), color);
+        quad[2] = sf::Vertex(sf::Vector2f(center.x + half, center.y + half), color);
+        quad[3] = sf::Vertex(sf::Vector2f(center.x - half, center.y + half), color);
+
+        if (node > 0) {
+            size_t parent = (node - 1) / heapArity;
+            sf::Color edgeColor = shown ? sf::Color(160, 160, 160) : sf::Color::Transparent;
+            sf::Vector2f from = centerOf(parent);
+            from.y += levels[nodeLevel[parent]].nodeSize / 2;
+            edges[(node - 1) * 2] = sf::Vertex(from, edgeColor);
+            edges[(node - 1) * 2 + 1] = sf::Vertex(sf::Vector2f(center.x, center.y - half), edgeColor);
+        }
+
+        if (node < labelCount) {
+            float maxWidth = shown ? 2 * half - 4 : -1.0f;
+            digits.build(&labels[node * MAX_CHARS * 4], array[node], center.x, center.y + CHARACTER_SIZE / 3.0f, maxWidth, true);
+        }
+    }
+
+    void buildColumn(size_t l, size_t column, const std::vector<int> &array) {
+        const Level &level = levels[l];
+        size_t first = level.first + (column * level.slots + level.fullColumns - 1) / level.fullColumns;
+        size_t last = level.first + std::min<size_t>(level.count, ((column + 1) * level.slots + level.fullColumns - 1) / level.fullColumns);
+        last = std::min(last, shownCount);
+
+        sf::Color color = sf::Color::Transparent;
+        if (first < last)
+            color = getColor(*std::max_element(array.begin() + first, array.begin() + last));
+
+        float left = (float)column * WINDOW_WIDTH / level.fullColumns;
+        float right = (float)(column + 1) * WINDOW_WIDTH / level.fullColumns;
+        sf::Vertex *quad = &nodes[(nodeLevel.size() + level.columnOffset + column) * 4]; // column quads follow the node quads
+        quad[0] = sf::Vertex(sf::Vector2f(left, level.y), color);
+        quad[1] = sf::Vertex(sf::Vector2f(right, level.y), color);
+        quad[2] = sf::Vertex(sf::Vector2f(right, level.y + level.nodeSize), color);
+        quad[3] = sf::Vertex(sf::Vector2f(left, level.y + level.nodeSize), color);
+    }
+
+    DigitGlyphs digits;
+    float top;
+    float bottom;
+    size_t nodeCount = 0;
+    int heapArity = 0;
+    size_t shownCount = 0;
+    size_t labelCount = 0;
+    std::vector<Level> levels;
+    std::vector<size_t> nodeLevel; // level of every node drawn on its own
+    sf::VertexArray nodes;
+    sf::VertexArray edges;
+    sf::VertexArray labels;
+    std::vector<bool> nodeDirty;
+    std::vector<bool> columnDirty;
+    std::vector<size_t> dirtyNodes;
+    std::vector<std::pair<size_t, size_t>> dirtyColumns; // (level, column)
+};
+
+void visualizeArray(sf::RenderTarget &target, BarRenderer &bars, const std::vector<int> &array, const std::vector<int> &touched, bool allTouched, const sf::Text &text, const HighlightBuffer &partitionColors) {
+    target.clear();
+    bars.update(array, touched, allTouched, partitionColors);
+    bars.draw(target);
+    countedDraw(target, text);
+}
+
+void drawArray(sf::RenderTarget &target, LabelLayer &labels, const std::vector<int> &array, const std::vector<int> &touched, bool allTouched) {
+    labels.update(array, touched, allTouched, nullptr, true);
+    labels.draw(target);
+}
+
+
+void visualizeBarsAndArrayMerge(sf::RenderTarget &target, BarRenderer &bars, LabelLayer &labels, HighlightBuffer &highlights, const std::vector<int> &array, const std::vector<int> &touched, bool allTouched, const sf::Text &text, int pivotIndex = -1, int leftIndex = -1, int rightIndex = -1) {
+    target.clear();
+
+    // Draw bars
+    highlights.clear();
+    if (leftIndex >= 0)
+        highlights.set(leftIndex, sf::Color::Green);
+    if (rightIndex >= 0)
+        highlights.set(rightIndex, sf::Color::Green);
+    if (pivotIndex >= 0)
+        highlights.set(pivotIndex, sf::Color::Red);
+    bars.update(array, touched, allTouched, highlights);
+    bars.draw(target);
+
+    // Draw array as squares
+    labels.update(array, touched, allTouched, nullptr, false);
+    labels.draw(target);
+
+    countedDraw(target, text);
+}
+
+
+
+void visualizeBarsAndArray(sf::RenderTarget &target, BarRenderer &bars, LabelLayer &labels, const std::vector<int> &array, const std::vector<int> &touched, bool allTouched, const sf::Text &text, const HighlightBuffer &partitionColors) {
+    target.clear();
+
+    // Draw bars
+    bars.update(array, touched, allTouched, partitionColors);
+    bars.draw(target);
+
+    // Draw array as squares
+    labels.update(array, touched, allTouched, &partitionColors, false);
+    labels.draw(target);
+
+    countedDraw(target, text);
+}
+
+// Draws the first sortedIndex elements as a heap where every node has arity children
+void visualizeHeap(sf::RenderTarget &target, HeapRenderer &heap, LabelLayer &labels, const std::vector<int> &array, const std::vector<int> &touched, bool allTouched, const sf::Text &text, int sortedIndex, int arity = 2) {
+    target.clear();
+
+    heap.update(array, touched, allTouched, sortedIndex, arity);
+    heap.draw(target);
+
+    drawArray(target, labels, array, touched, allTouched);
+
+    countedDraw(target, text);
+}
+
+// Step trace engine
+// The sorting functions no longer draw anything themselves: they record what they do
+// into a StepTrace, and a TracePlayer replays that trace at whatever speed the user wants.
+// A STEP_BATCH marker comes before and after a group of steps that happen at once (b = 0 on
+// the opening marker, 1 on the closing one, a = number of steps in between). A STEP_RUN marks
+// [a, b] as one sorted run, replacing the runs it overlaps.
+enum StepType : std::uint8_t {STEP_COMPARE, STEP_SWAP, STEP_WRITE, STEP_PIVOT, STEP_RANGE, STEP_BATCH, STEP_RUN};
+
+struct Step {
+    StepType type;
+    int a; // first index (write target, pivot index or range/run start)
+    int b; // second index (value written or range/run end)
+};
+
+// Receives steps as they are recorded instead of letting the trace keep them. tick is the
+// step's stamp from the trace's shared clock, or 0 when it has none.
+class StepSink {
+public:
+    virtual ~StepSink() {}
+    virtual void push(const Step &step, std::uint64_t tick) = 0;
+};
+
+// Besides the steps themselves, the trace counts operations and auxiliary memory.
+// A trace built with keepSteps = false only counts, which is what the benchmark mode uses.
+class StepTrace {
+public:
+    explicit StepTrace(bool keepSteps = true) : keepSteps(keepSteps) {}
+
+    void compare(int i, int j) {
+        comparisons++;
+        record({STEP_COMPARE, i, j});
+    }
+    void swap(int i, int j) {
+        swaps++;
+        record({STEP_SWAP, i, j});
+    }
+    void write(int index, int value) {
+        writes++;
+        record({STEP_WRITE, index, value});
+    }
+    void pivot(int index) { record({STEP_PIVOT, index, 0}); }
+    void range(int low, int high) { record({STEP_RANGE, low, high}); }
+    void run(int low, int high) { record({STEP_RUN, low, high}); }
+
+    // Records steps that happen at once, like one stage of a sorting network. The whole
+    // group shares a single clock tick, so merging per-thread traces never splits it.
+    void batch(const std::vector<Step> &group) {
+        for (const Step &step : group) {
+            if (step.type == STEP_COMPARE)
+                comparisons++;
+            else if (step.type == STEP_SWAP)
+                swaps++;
+            else if (step.type == STEP_WRITE)
+                writes++;
+        }
+        if (!keepSteps)
+            return;
+        std::uint64_t tick = clock ? clock->fetch_add(1, std::memory_order_relaxed) : 0;
+        emit({STEP_BATCH, (int)group.size(), 0}, tick);
+        for (const Step &step : group)
+            emit(step, tick);
+        emit({STEP_BATCH, (int)group.size(), 1}, tick);
+    }
+
+    // Operations done without recording them one by one
+    void count(std::uint64_t addedComparisons, std::uint64_t addedSwaps) {
+        comparisons += addedComparisons;
+        swaps += addedSwaps;
+    }
+
+    // Auxiliary buffers the algorithm holds on top of the input array
+    void allocate(size_t bytes) {
+        extraBytes += bytes;
+        peakExtraBytes = std::max(peakExtraBytes, extraBytes);
+    }
+    void release(size_t bytes) { extraBytes -= bytes; }
+
+    // Traces recorded by different threads stamp their steps from one shared clock, so a
+    // sink can merge them back into a single stream in the order the steps happened.
+    void setClock(std::atomic<std::uint64_t> *sharedClock) { clock = sharedClock; }
+
+    // Streams every recorded step to sink instead of storing it
+    void setSink(StepSink *stepSink) { sink = stepSink; }
+
+    void append(const Step &step) { record(step); }
+
+    // Adds the operation counts and buffer peaks of traces recorded by other threads
+    void absorbCounts(const std::vector<StepTrace> &parts) {
+        for (const StepTrace &part : parts) {
+            comparisons += part.comparisons;
+            swaps += part.swaps;
+            writes += part.writes;
+            allocate(part.peakExtraBytes);
+        }
+    }
+
+    void clear() {
+        steps.clear();
+        dropped = 0;
+    }
+    // Frees the steps before first. They can no longer be read, but the later steps keep
+    // their indices.
+    void dropBefore(size_t first) {
+        first = std::min(first, size());
+        if (first > dropped) {
+            steps.erase(steps.begin(), steps.begin() + (first - dropped));
+            dropped = first;
+        }
+    }
+    bool isKeepingSteps() const { return keepSteps; }
+    size_t size() const { return dropped + steps.size(); }
+    const Step &operator[](size_t i) const { return steps[i - dropped]; }
+
+    std::uint64_t getComparisons() const { return comparisons; }
+    std::uint64_t getSwaps() const { return swaps; }
+    std::uint64_t getWrites() const { return writes; }
+    size_t getPeakExtraBytes() const { return peakExtraBytes; }
+
+private:
+    void record(const Step &step) {
+        if (!keepSteps)
+            return;
+        emit(step, clock ? clock->fetch_add(1, std::memory_order_relaxed) : 0);
+    }
+
+    void emit(const Step &step, std::uint64_t tick) {
+        if (sink) {
+            sink->push(step, tick);
+            return;
+        }
+        steps.push_back(step);
+    }
+
+    bool keepSteps;
+    std::atomic<std::uint64_t> *clock = nullptr;
+    StepSink *sink = nullptr;
+    std::vector<Step> steps;
+    size_t dropped = 0; // steps freed by dropBefore
+    std::uint64_t comparisons = 0;
+    std::uint64_t swaps = 0;
+    std::uint64_t writes = 0;
+    size_t extraBytes = 0;
+    size_t peakExtraBytes = 0;
+};
+
+// Trace files
+// A trace is stored as an opcode byte per step followed by varints. The first index of a step
+// is a zigzag delta from the previous step's, and small deltas fit in the opcode's top four
+// bits; the second is a delta from the first, or the written value itself. Steps are grouped
+// in chunks of about 4096 that never split a batch and decode on their own. Every so often
+// a chunk is preceded by a keyframe, a snapshot of the array and the pivot and range, so a
+// reader can jump anywhere by restoring the keyframe before it and replaying from there.
+//
+// Layout: TraceHeader, then the keyframes and chunks, then the index: one {first step, offset}
+// pair per chunk followed by one per keyframe. Fields wider than a byte are stored in the byte
+// order of the machine that wrote the file; the header's byteOrder marker records it, and a
+// machine of the other order refuses the file. Files from before the marker have 0 there and
+// were only ever written little-endian.
+struct TraceHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t algorithm;
+    std::uint64_t arraySize;
+    std::uint64_t steps;
+    std::uint64_t chunks;
+    std::uint64_t keyframes;
+    std::uint64_t indexOffset;
+    std::uint64_t seed;
+    std::uint8_t distribution;
+    std::uint8_t heapArity;
+    std::uint8_t bottomUpHeap;
+    std::uint8_t networkBlock;
+    std::uint32_t byteOrder; // TRACE_BYTE_ORDER as the writer stored it
+};
+static_assert(sizeof(TraceHeader) == 72, "TraceHeader is written as is");
+
+const char TRACE_MAGIC[8] = {'S', 'O', 'R', 'T', 'T', 'R', 'C', 'E'};
+const std::uint32_t TRACE_VERSION = 1;
+const std::uint32_t TRACE_BYTE_ORDER = 0x01020304;
+const size_t TRACE_CHUNK_STEPS = 4096;
+const size_t KEYFRAME_HEADER_BYTES = 16; // pivot, range low, range high, padding
+
+inline std::uint64_t zigzag(std::int64_t value) { return ((std::uint64_t)value << 1) ^ (std::uint64_t)(value >> 63); }
+inline std::int64_t unzigzag(std::uint64_t value) { return (std::int64_t)(value >> 1) ^ -(std::int64_t)(value & 1); }
+
+inline void putVarint(std::vector<std::uint8_t> &out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((std::uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((std::uint8_t)value);
+}
+
+// Returns false when the varint runs past end
+inline bool getVarint(const std::uint8_t *&data, const std::uint8_t *end, std::uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && data < end; shift += 7) {
+        std::uint8_t byte = *data++;
+        value |= (std::uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void encodeStep(std::vector<std::uint8_t> &out, const Step &step, int &previous) {
+    if (step.type == STEP_BATCH) {
+        out.push_back(STEP_BATCH | (step.b ? 0x08 : 0));
+        putVarint(out, step.a);
+        return;
+    }
+    std::uint64_t delta = zigzag((std::int64_t)step.a - previous);
+    previous = step.a;
+    out.push_back((std::uint8_t)(step.type | std::min<std::uint64_t>(delta, 15) << 4));
+    if (delta >= 15)
+        putVarint(out, delta - 15);
+    if (step.type != STEP_PIVOT)
+        putVarint(out, zigzag(step.type == STEP_WRITE ? (std::int64_t)step.b : (std::int64_t)step.b - step.a));
+}
+
+// Writes a trace file as the steps come in, so a trace never has to fit in memory: only the
+// chunk being encoded and a copy of the array for the keyframes are kept. It is a StepSink,
+// so a StepTrace can record straight into it. The header's algorithm, seed, distribution and
+// sort options are kept as given; the rest is filled in by finish(). A writer destroyed
+// before finish() removes its unfinished file.
+class TraceWriter : public StepSink {
+public:
+    TraceWriter() = default;
+    ~TraceWriter() { abandon(); }
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    // Returns false (after printing why) when path cannot be written
+    bool open(const std::string &filePath, const TraceHeader &fileHeader, const std::vector<int> &initial) {
+        path = filePath;
+        file.open(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open " << path << " for writing\n";
+            return false;
+        }
+        header = fileHeader;
+        std::copy_n(TRACE_MAGIC, 8, header.magic);
+        header.version = TRACE_VERSION;
+        header.byteOrder = TRACE_BYTE_ORDER;
+        header.arraySize = initial.size();
+        file.write((const char *)&header, sizeof(header));
+        offset = sizeof(header);
+        array = initial;
+        // A keyframe costs as much as the array, so bigger arrays get them less often
+        keyframeInterval = std::max<size_t>(1 << 16, initial.size() * 2);
+        return true;
+    }
+
+    void push(const Step &step, std::uint64_t) override { append(step); }
+
+    void append(const Step &step) {
+        // Chunks start on a step boundary outside any batch
+        if (steps == 0 || (!inBatch && steps - chunkStart >= TRACE_CHUNK_STEPS))
+            startChunk();
+        encodeStep(bytes, step, previous);
+        steps++;
+        switch (step.type) {
+            case STEP_SWAP:
+                std::swap(array[step.a], array[step.b]);
+                break;
+            case STEP_WRITE:
+                array[step.a] = step.b;
+                break;
+            case STEP_PIVOT:
+                state[0] = step.a;
+                break;
+            case STEP_RANGE:
+                state[1] = step.a;
+                state[2] = step.b;
+                break;
+            case STEP_BATCH:
+                inBatch = step.b == 0;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Writes the index and the final header. Returns false (after printing why) when the file
+    // could not be written.
+    bool finish() {
+        if (steps == 0)
+            startChunk();
+        flush();
+        header.steps = steps;
+        header.chunks = chunkIndex.size() / 2;
+        header.keyframes = keyframeIndex.size() / 2;
+        header.indexOffset = offset;
+        file.write((const char *)chunkIndex.data(), chunkIndex.size() * sizeof(std::uint64_t));
+        file.write((const char *)keyframeIndex.data(), keyframeIndex.size() * sizeof(std::uint64_t));
+        file.seekp(0);
+        file.write((const char *)&header, sizeof(header));
+        file.close();
+        std::string written = std::move(path);
+        path.clear();
+        if (!file) {
+            std::cerr << "Could not write " << written << "\n";
+            std::remove(written.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Closes and removes the file, unless it was finished
+    void abandon() {
+        if (path.empty())
+            return;
+        file.close();
+        std::remove(path.c_str());
+        path.clear();
+    }
+
+    const std::string &getPath() const { return path; }
+    size_t size() const { return steps; }
+
+private:
+    void flush() {
+        file.write((const char *)bytes.data(), bytes.size());
+        offset += bytes.size();
+        bytes.clear();
+    }
+
+    void startChunk() {
+        flush();
+        if (steps == 0 || steps - lastKeyframe >= keyframeInterval) {
+            keyframeIndex.push_back(steps);
+            keyframeIndex.push_back(offset);
+            file.write((const char *)state, sizeof(state));
+            file.write((const char *)array.data(), array.size() * sizeof(int));
+            offset += sizeof(state) + array.size() * sizeof(int);
+            lastKeyframe = steps;
+        }
+        chunkIndex.push_back(steps);
+        chunkIndex.push_back(offset);
+        chunkStart = steps;
+        previous = 0;
+    }
+
+    std::ofstream file;
+    std::string path; // empty once the file is finished or abandoned
+    TraceHeader header{};
+    std::vector<int> array; // the array as of the last step written
+    std::int32_t state[4] = {-1, -1, -1, 0}; // pivot, range low, range high, padding
+    std::vector<std::uint64_t> chunkIndex, keyframeIndex;
+    std::vector<std::uint8_t> bytes; // the chunk being encoded
+    std::uint64_t offset = 0;
+    size_t keyframeInterval = 0;
+    size_t steps = 0, chunkStart = 0, lastKeyframe = 0;
+    bool inBatch = false;
+    int previous = 0;
+};
+
+// Read-only view of a trace file. On Linux the file is memory-mapped, so opening it costs the
+// same however long the trace is; elsewhere it is read into memory. Chunks are decoded on
+// demand, and the last few are cached.
+class TraceFile {
+public:
+    TraceFile() = default;
+    ~TraceFile() {
+#ifdef __linux__
+        if (mapping)
+            munmap(mapping, length);
+#endif
+    }
+    TraceFile(const TraceFile &) = delete;
+    TraceFile &operator=(const TraceFile &) = delete;
+
+    // Returns false (after printing why) when path is not a readable trace file
+    bool open(const std::string &path) {
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            std::cerr << "Cannot open " << path << "\n";
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        length = info.st_size;
+        if (length > 0) {
+            mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+                mapping = nullptr;
+        }
+        close(fd);
+        if (!mapping) {
+            std::cerr << "Cannot map " << path << "\n";
+            return false;
+        }
+        data = (const std::uint8_t *)mapping;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open " << path << "\n";
+            return false;
+        }
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = (const std::uint8_t *)contents.data();
+        length = contents.size();
+#endif
+        if (!validate()) {
+            std::cerr << path << " is not a valid trace file\n";
+            return false;
+        }
+        chunkSteps.assign(CACHED_CHUNKS, std::vector<Step>());
+        cachedChunk.assign(CACHED_CHUNKS, SIZE_MAX);
+        chunkFirst.assign(CACHED_CHUNKS, 0);
+        return true;
+    }
+
+    const TraceHeader &getHeader() const { return header; }
+    size_t size() const { return header.steps; }
+
+    const Step &operator[](size_t i) {
+        // Replay reads steps in order, so the chunk used last almost always has it
+        if (i - chunkFirst[lastSlot] < chunkSteps[lastSlot].size())
+            return chunkSteps[lastSlot][i - chunkFirst[lastSlot]];
+        size_t chunk = findEntry(CHUNK_TABLE, header.chunks, i);
+        size_t slot = 0;
+        while (slot < CACHED_CHUNKS && cachedChunk[slot] != chunk)
+            slot++;
+        if (slot == CACHED_CHUNKS) {
+            slot = nextSlot;
+            nextSlot = (nextSlot + 1) % CACHED_CHUNKS;
+            decodeChunk(chunk, chunkSteps[slot]);
+            cachedChunk[slot] = chunk;
+            chunkFirst[slot] = entry(CHUNK_TABLE, chunk, 0);
+        }
+        lastSlot = slot;
+        return chunkSteps[slot][i - chunkFirst[slot]];
+    }
+
+    // The last keyframe at or before step i: where it is, and the state it holds
+    size_t keyframeBefore(size_t i) const { return entry(KEYFRAME_TABLE, findEntry(KEYFRAME_TABLE, header.keyframes, i), 0); }
+    void readKeyframe(size_t step, std::vector<int> &array, int &pivot, int &rangeLow, int &rangeHigh) const {
+        const std::uint8_t *keyframe = data + entry(KEYFRAME_TABLE, findEntry(KEYFRAME_TABLE, header.keyframes, step), 1);
+        std::int32_t state[4];
+        std::memcpy(state, keyframe, sizeof(state));
+        pivot = validIndex(state[0]) ? state[0] : -1;
+        // A range needs both ends; anything else means no range
+        bool range = state[1] >= 0 && state[2] >= 0 && validIndex(state[1]) && validIndex(state[2]);
+        rangeLow = range ? state[1] : -1;
+        rangeHigh = range ? state[2] : -1;
+        array.resize(header.arraySize);
+        std::memcpy(array.data(), keyframe + KEYFRAME_HEADER_BYTES, array.size() * sizeof(int));
+    }
+
+private:
+    static const size_t CACHED_CHUNKS = 4;
+    enum Table {CHUNK_TABLE, KEYFRAME_TABLE};
+
+    std::uint64_t entry(Table table, size_t index, int field) const {
+        size_t offset = header.indexOffset + (table == KEYFRAME_TABLE ? header.chunks * 16 : 0) + index * 16 + field * 8;
+        std::uint64_t value;
+        std::memcpy(&value, data + offset, sizeof(value));
+        return value;
+    }
+
+    // Index of the last entry whose first step is at or before step
+    size_t findEntry(Table table, size_t count, size_t step) const {
+        size_t low = 0, high = count;
+        while (high - low > 1) {
+            size_t mid = low + (high - low) / 2;
+            if (entry(table, mid, 0) <= step)
+                low = mid;
+            else
+                high = mid;
+        }
+        return low;
+    }
+
+    bool validIndex(std::int64_t index) const { return index >= -1 && index < (std::int64_t)header.arraySize; }
+
+    // Checks everything the player relies on up front, so a damaged file cannot make it
+    // index outside the array. Only the index is read; chunks are checked as they decode.
+    bool validate() {
+        if (length < sizeof(header))
+            return false;
+        std::memcpy(&header, data, sizeof(header));
+        std::uint16_t probe = 1;
+        bool littleEndian = *(const std::uint8_t *)&probe == 1;
+        if (header.byteOrder != TRACE_BYTE_ORDER && !(header.byteOrder == 0 && littleEndian)) {
+            std::cerr << "The trace was written on a machine with a different byte order\n";
+            return false;
+        }
+        if (std::memcmp(header.magic, TRACE_MAGIC, 8) != 0 || header.version != TRACE_VERSION || header.arraySize == 0
+            || header.arraySize > (length - sizeof(header)) / sizeof(int) || header.chunks == 0 || header.keyframes == 0
+            || header.indexOffset < sizeof(header) || header.indexOffset > length
+            || (length - header.indexOffset) / 16 != header.chunks + header.keyframes || (length - header.indexOffset) % 16 != 0)
+            return false;
+        size_t keyframeBytes = KEYFRAME_HEADER_BYTES + header.arraySize * sizeof(int);
+        for (size_t i = 0; i < header.chunks; ++i) {
+            std::uint64_t first = entry(CHUNK_TABLE, i, 0), offset = entry(CHUNK_TABLE, i, 1);
+            if ((i == 0 ? first != 0 : first <= entry(CHUNK_TABLE, i - 1, 0) || offset < entry(CHUNK_TABLE, i - 1, 1))
+                || (first >= header.steps && header.steps > 0) || offset < sizeof(header) || offset > header.indexOffset)
+                return false;
+            // Every step takes at least a byte, which bounds the steps a chunk can claim
+            std::uint64_t last = i + 1 < header.chunks ? entry(CHUNK_TABLE, i + 1, 0) : header.steps;
+            std::uint64_t end = i + 1 < header.chunks ? entry(CHUNK_TABLE, i + 1, 1) : header.indexOffset;
+            if (last > first && end >= offset && last - first > end - offset)
+                return false;
+        }
+        for (size_t i = 0; i < header.keyframes; ++i) {
+            std::uint64_t first = entry(KEYFRAME_TABLE, i, 0), offset = entry(KEYFRAME_TABLE, i, 1);
+            if ((i == 0 ? first != 0 : first <= entry(KEYFRAME_TABLE, i - 1, 0)) || first > header.steps
+                || offset < sizeof(header) || offset > header.indexOffset || header.indexOffset - offset < keyframeBytes
+                || offset > length || length - offset < keyframeBytes)
+                return false;
+        }
+        return true;
+    }
+
+    // A chunk that does not decode cleanly is replaced by harmless compares
+    void decodeChunk(size_t chunk, std::vector<Step> &steps) {
+        std::uint64_t first = entry(CHUNK_TABLE, chunk, 0);
+        std::uint64_t last = chunk + 1 < header.chunks ? entry(CHUNK_TABLE, chunk + 1, 0) : header.steps;
+        const std::uint8_t *in = data + entry(CHUNK_TABLE, chunk, 1);
+        const std::uint8_t *end = data + (chunk + 1 < header.chunks ? entry(CHUNK_TABLE, chunk + 1, 1) : header.indexOffset);
+        steps.resize(last - first);
+
+        bool valid = true;
+        std::int64_t previous = 0;
+        for (size_t i = 0; i < steps.size() && valid; ++i) {
+            if (in >= end) {
+                valid = false;
+                break;
+            }
+            std::uint8_t opcode = *in++;
+            Step &step = steps[i];
+            step.type = (StepType)(opcode & 0x07);
+            std::uint64_t value;
+            if (step.type == STEP_BATCH) {
+                valid = getVarint(in, end, value) && value < steps.size();
+                step.a = (int)value;
+                step.b = (opcode & 0x08) ? 1 : 0;
+                continue;
+            }
+            // Index deltas are bounded so that adding them cannot overflow
+            const std::uint64_t MAX_DELTA = 1ull << 40;
+            std::uint64_t delta = opcode >> 4;
+            if (delta == 15) {
+                valid = getVarint(in, end, value) && value < MAX_DELTA;
+                delta += value;
+            }
+            if (!valid)
+                break;
+            std::int64_t a = previous + unzigzag(delta), b = 0;
+            previous = a;
+            if (step.type != STEP_PIVOT) {
+                valid = valid && getVarint(in, end, value) && (step.type == STEP_WRITE || value < MAX_DELTA);
+                b = step.type == STEP_WRITE ? unzigzag(value) : a + unzigzag(value);
+            }
+            switch (step.type) {
+                case STEP_COMPARE:
+                case STEP_SWAP:
+                    valid = valid && a >= 0 && validIndex(a) && b >= 0 && validIndex(b);
+                    break;
+                case STEP_WRITE:
+                    valid = valid && a >= 0 && validIndex(a) && b >= INT_MIN && b <= INT_MAX;
+                    break;
+                case STEP_PIVOT:
+                    valid = valid && validIndex(a);
+                    break;
+                case STEP_RANGE:
+                    valid = valid && validIndex(a) && validIndex(b) && (a >= 0) == (b >= 0);
+                    break;
+                case STEP_RUN:
+                    valid = valid && a >= 0 && a <= b && validIndex(b);
+                    break;
+                default:
+                    valid = false;
+            }
+            step.a = (int)a;
+            step.b = (int)b;
+        }
+        // Every batch has to open and close inside the chunk, around the number of steps it claims
+        for (size_t i = 0; i < steps.size() && valid; ++i) {
+            if (steps[i].type != STEP_BATCH)
+                continue;
+            size_t close = i + steps[i].a + 1;
+            valid = steps[i].b == 0 && close < steps.size() && steps[close].type == STEP_BATCH && steps[close].b == 1 && steps[close].a == steps[i].a;
+            i = close;
+        }
+        if (!valid) {
+            std::cerr << "Chunk " << chunk << " of the trace is damaged and is skipped\n";
+            std::fill(steps.begin(), steps.end(), Step{STEP_COMPARE, 0, 0});
+        }
+    }
+
+    TraceHeader header{};
+    const std::uint8_t *data = nullptr;
+    size_t length = 0;
+#ifdef __linux__
+    void *mapping = nullptr;
+#else
+    std::string contents;
+#endif
+    std::vector<std::vector<Step>> chunkSteps;
+    std::vector<size_t> cachedChunk;
+    std::vector<size_t> chunkFirst;
+    size_t nextSlot = 0;
+    size_t lastSlot = 0;
+};
+
+// Replays a recorded trace on top of a copy of the input array.
+// Writes, pivots, ranges and runs push what they overwrote on an undo stack so the player can
+// rewind. A trace loaded from a file is replayed from its keyframes instead: the undo stack only
+// goes back to the last keyframe restored, and anything earlier restores an earlier one.
+// Keyframes do not hold the runs, so after restoring one only the runs recorded since show.
+class TracePlayer {
+public:
+    void load(const std::vector<int> &initialArray, StepTrace newTrace) {
+        initial = initialArray;
+        trace = std::move(newTrace);
+        file.reset();
+        restart(initialArray);
+    }
+
+    void load(std::unique_ptr<TraceFile> traceFile) {
+        trace = StepTrace();
+        initial.clear();
+        file = std::move(traceFile);
+        restart(std::vector<int>());
+        restoreKeyframe(0);
+    }
+
+    // A batch counts as one step: its markers and everything between them are applied together
+    bool stepForward() {
+        if (position >= getLength())
+            return false;
+        if (stepAt(position).type == STEP_BATCH) {
+            size_t end = position + stepAt(position).a + 2;
+            // A running sort may not have streamed the rest of the batch in yet
+            if (end > getLength())
+                return false;
+            while (position < end)
+                apply(stepAt(position++));
+            return true;
+        }
+        apply(stepAt(position++));
+        return true;
+    }
+
+    bool stepBackward() {
+        if (position == 0)
+            return false;
+        const Step &last = stepAt(position - 1);
+        size_t begin = last.type == STEP_BATCH ? position - last.a - 2 : position - 1;
+        if (position == undoBase) {
+            if (!file)
+                return false;
+            restoreKeyframe(file->keyframeBefore(begin));
+            while (position < begin && stepForward()) {
+            }
+            return true;
+        }
+        while (position > begin)
+            revert(stepAt(--position));
+        return true;
+    }
+
+    // Seeking into the middle of a batch stops just past it (or just before it when rewinding)
+    void seek(size_t target) {
+        target = std::min(target, getLength());
+        bool rewinding = target < position;
+        if (file) {
+            // Restart from a keyframe rather than replay or rewind past one
+            size_t keyframe = file->keyframeBefore(target);
+            if ((target >= position && keyframe > position) || target < undoBase)
+                restoreKeyframe(keyframe);
+        }
+        if (target >= position) {
+            // After rewinding to a keyframe, stop short of a batch that target falls inside
+            while (position < target && (!rewinding || nextStepEnd() <= target) && stepForward()) {
+            }
+        } else {
+            while (position > target)
+                stepBackward();
+        }
+    }
+
+    // Advances playback by the number of steps that fit in the elapsed time.
+    void update(float seconds) {
+        if (paused || finished())
+            return;
+        pending += seconds * stepsPerSecond;
+        size_t count = (size_t)pending;
+        pending -= count;
+        seek(position + count);
+    }
+
+    // Adds a step streamed in by a running sort to the end of the trace
+    void append(const Step &step) { trace.append(step); }
+
+    // Frees the steps played so far except the last one (or batch), which the renderers still
+    // read. Memory then stays bounded by the steps streamed in ahead of the playback, but the
+    // player can no longer step back past this point.
+    void trim() {
+        if (file || position == 0)
+            return;
+        const Step &last = stepAt(position - 1);
+        trace.dropBefore(last.type == STEP_BATCH ? position - last.a - 2 : position - 1);
+        undo.clear();
+        undoBase = position;
+    }
+
+    // What a save needs; only meaningful when the trace was not loaded from a file
+    bool isFromFile() const { return file != nullptr; }
+    const std::vector<int> &getInitial() const { return initial; }
+    const StepTrace &getTrace() const { return trace; }
+
+    void togglePause() { paused = !paused; }
+    void faster() { stepsPerSecond = std::min(stepsPerSecond * 2.0f, 1e7f); }
+    void slower() { stepsPerSecond = std::max(stepsPerSecond / 2.0f, 1.0f); }
+    void setSpeed(float speed) { stepsPerSecond = std::max(speed, 1.0f); }
+
+    bool finished() const { return position >= getLength(); }
+    bool isPaused() const { return paused; }
+    float getSpeed() const { return stepsPerSecond; }
+    size_t getPosition() const { return position; }
+    size_t getLength() const { return file ? file->size() : trace.size(); }
+    const std::vector<int> &getArray() const { return array; }
+    const Step *lastStep() const { return position > 0 ? &stepAt(position - 1) : nullptr; }
+    // Steps of the batch that was applied last, or 0 if the last step was not a batch
+    size_t lastBatch(const Step *&first) const {
+        const Step *step = lastStep();
+        if (!step || step->type != STEP_BATCH)
+            return 0;
+        first = &stepAt(position - 1 - step->a);
+        return step->a;
+    }
+    int getPivot() const { return pivotIndex; }
+    int getRangeLow() const { return rangeLow; }
+    int getRangeHigh() const { return rangeHigh; }
+    // The sorted runs recorded so far, as disjoint [first, last] pairs in index order
+    const std::vector<std::pair<int, int>> &getRuns() const { return runs; }
+
+    // Indices changed since the last clearTouched(), for renderers that only redraw what moved
+    const std::vector<int> &getTouched() const { return touched; }
+    bool isAllTouched() const { return allTouched; }
+    void clearTouched() {
+        touched.clear();
+        allTouched = false;
+    }
+
+private:
+    const Step &stepAt(size_t i) const { return file ? (*file)[i] : trace[i]; }
+    size_t nextStepEnd() const {
+        const Step &next = stepAt(position);
+        return position + (next.type == STEP_BATCH ? next.a + 2 : 1);
+    }
+
+    void restart(const std::vector<int> &startArray) {
+        array = startArray;
+        undo.clear();
+        undoBase = 0;
+        position = 0;
+        pivotIndex = -1;
+        rangeLow = -1;
+        rangeHigh = -1;
+        runs.clear();
+        pending = 0.0f;
+        touched.clear();
+        allTouched = true;
+    }
+
+    void restoreKeyframe(size_t step) {
+        file->readKeyframe(step, array, pivotIndex, rangeLow, rangeHigh);
+        position = undoBase = step;
+        runs.clear();
+        undo.clear();
+        touched.clear();
+        allTouched = true;
+    }
+
+    void apply(const Step &step) {
+        switch (step.type) {
+            case STEP_COMPARE:
+            case STEP_BATCH:
+                break;
+            case STEP_SWAP:
+                std::swap(array[step.a], array[step.b]);
+                touch(step.a);
+                touch(step.b);
+                break;
+            case STEP_WRITE:
+                undo.push_back(array[step.a]);
+                array[step.a] = step.b;
+                touch(step.a);
+                break;
+            case STEP_PIVOT:
+                undo.push_back(pivotIndex);
+                pivotIndex = step.a;
+                break;
+            case STEP_RANGE:
+                undo.push_back(rangeLow);
+                undo.push_back(rangeHigh);
+                rangeLow = step.a;
+                rangeHigh = step.b;
+                break;
+            case STEP_RUN: {
+                // The runs it overlaps go on the undo stack, followed by how many there were
+                auto first = std::lower_bound(runs.begin(), runs.end(), step.a, [](const std::pair<int, int> &run, int low) { return run.second < low; });
+                auto last = first;
+                for (; last != runs.end() && last->first <= step.b; ++last) {
+                    undo.push_back(last->first);
+                    undo.push_back(last->second);
+                }
+                undo.push_back(last - first);
+                runs.insert(runs.erase(first, last), {step.a, step.b});
+                break;
+            }
+        }
+    }
+
+    void revert(const Step &step) {
+        switch (step.type) {
+            case STEP_COMPARE:
+            case STEP_BATCH:
+                break;
+            case STEP_SWAP:
+                std::swap(array[step.a], array[step.b]);
+                touch(step.a);
+                touch(step.b);
+                break;
+            case STEP_WRITE:
+                array[step.a] = undo.back();
+                undo.pop_back();
+                touch(step.a);
+                break;
+            case STEP_PIVOT:
+                pivotIndex = undo.back();
+                undo.pop_back();
+                break;
+            case STEP_RANGE:
+                rangeHigh = undo.back();
+                undo.pop_back();
+                rangeLow = undo.back();
+                undo.pop_back();
+                break;
+            case STEP_RUN: {
+                auto at = runs.erase(std::lower_bound(runs.begin(), runs.end(), std::make_pair(step.a, step.b)));
+                int count = undo.back();
+                undo.pop_back();
+                for (; count > 0; count--) {
+                    int high = undo.back();
+                    undo.pop_back();
+                    int low = undo.back();
+                    undo.pop_back();
+                    at = runs.insert(at, {low, high});
+                }
+                break;
+            }
+        }
+    }
+
+    void touch(int index) {
+        if (allTouched)
+            return;
+        // A long seek touches most of the array anyway, so just redraw everything
+        if (touched.size() >= array.size()) {
+            touched.clear();
+            allTouched = true;
+            return;
+        }
+        touched.push_back(index);
+    }
+
+    std::vector<int> array;
+    std::vector<int> initial;
+    StepTrace trace;
+    std::unique_ptr<TraceFile> file;
+    std::vector<int> undo;
+    size_t undoBase = 0; // steps before this have no undo entries (file traces only)
+    std::vector<int> touched;
+    bool allTouched = true;
+    size_t position = 0;
+    int pivotIndex = -1;
+    int rangeLow = -1;
+    int rangeHigh = -1;
+    std::vector<std::pair<int, int>> runs;
+    float stepsPerSecond = 20.0f;
+    float pending = 0.0f;
+    bool paused = false;
+};
+
+// Comparators and recorders for the sort kernels
+// Projection that hands back the element itself
+struct Identity {
+    template <typename T>
+    constexpr T &&operator()(T &&value) const noexcept { return std::forward<T>(value); }
+};
+
+// What the kernels call less: comp applied to the projected keys
+template <typename Compare, typename Projection>
+struct ProjectedLess {
+    Compare comp;
+    Projection proj;
+
+    template <typename T>
+    bool operator()(const T &x, const T &y) const { return std::invoke(comp, std::invoke(proj, x), std::invoke(proj, y)); }
+};
+using DefaultLess = ProjectedLess<std::less<>, Identity>;
+
+// Recorder for sorts nobody watches: every hook is empty, so an instantiation with it
+// compiles to the bare algorithm
+struct NullRecorder {
+    void compare(int, int) {}
+    void swap(int, int) {}
+    template <typename T>
+    void write(int, const T &) {}
+    void pivot(int) {}
+    void range(int, int) {}
+    void run(int, int) {}
+    void batch(const std::vector<Step> &) {}
+    void count(std::uint64_t, std::uint64_t) {}
+    void allocate(size_t) {}
+    void release(size_t) {}
+    constexpr bool isKeepingSteps() const { return false; }
+};
+
+// Sorting networks
+// Bitonic networks of N = 8, 16, 32 or 64 inputs, in the form where every comparator puts
+// the smaller key at the lower index. With that orientation a range shorter than N can be
+// padded with INT_MAX, or its comparators that reach past the end simply left out.
+template <int N, typename Exchange, typename StageEnd>
+inline void bitonicStages(Exchange &&exchange, StageEnd &&stageEnd) {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "network size must be a power of two");
+    for (int k = 2; k <= N; k *= 2) {
+        for (int start = 0; start < N; start += k)
+            for (int i = 0; i < k / 2; ++i)
+                exchange(start + i, start + k - 1 - i);
+        stageEnd();
+        for (int j = k / 4; j >= 1; j /= 2) {
+            for (int start = 0; start < N; start += 2 * j)
+                for (int i = 0; i < j; ++i)
+                    exchange(start + i, start + i + j);
+            stageEnd();
+        }
+    }
+}
+
+template <int N>
+constexpr std::uint64_t bitonicComparators() {
+    int stages = 0;
+    for (int k = 2; k <= N; k *= 2)
+        for (int j = k / 2; j >= 1; j /= 2)
+            stages++;
+    return (std::uint64_t)stages * (N / 2);
+}
+
+// Branch-free scalar kernel: every comparator is a min and a max.
+// Counts the comparators that actually exchanged keys.
+template <int N>
+void networkKernelScalar(int *keys, std::uint64_t &swaps) {
+    bitonicStages<N>([&](int i, int j) {
+        int x = keys[i], y = keys[j];
+        swaps += x > y;
+        keys[i] = std::min(x, y);
+        keys[j] = std::max(x, y);
+    }, [] {});
+}
+
+#ifdef HAVE_X86_SIMD
+// AVX2 kernel: the N keys live in N / 8 registers. Stages whose comparators span at least
+// 8 keys compare whole registers; shorter ones pair up lanes of one register with a permute.
+#define NETWORK_TARGET __attribute__((target("avx2,popcnt")))
+
+// Lane l meets lane l ^ partnerMask; the lanes with highBit set keep the larger key
+NETWORK_TARGET __attribute__((always_inline)) inline __m256i exchangeLanes(__m256i v, int partnerMask, int highBit, std::uint64_t &swaps) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i partner = _mm256_permutevar8x32_epi32(v, _mm256_xor_si256(lanes, _mm256_set1_epi32(partnerMask)));
+    __m256i upper = _mm256_cmpeq_epi32(_mm256_and_si256(lanes, _mm256_set1_epi32(highBit)), _mm256_set1_epi32(highBit));
+    int exchanged = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(upper, _mm256_cmpgt_epi32(v, partner))));
+    swaps += __builtin_popcount(exchanged);
+    return _mm256_blendv_epi8(_mm256_min_epi32(v, partner), _mm256_max_epi32(v, partner), upper);
+}
+
+// Comparators from every lane of a to the same lane of b
+NETWORK_TARGET __attribute__((always_inline)) inline void exchangeRegisters(__m256i &a, __m256i &b, std::uint64_t &swaps) {
+    swaps += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b))));
+    __m256i low = _mm256_min_epi32(a, b);
+    b = _mm256_max_epi32(a, b);
+    a = low;
+}
+
+// Comparators from lane l of a to lane 7 - l of b
+NETWORK_TARGET __attribute__((always_inline)) inline void exchangeMirrored(__m256i &a, __m256i &b, std::uint64_t &swaps) {
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256i reversed = _mm256_permutevar8x32_epi32(b, reverse);
+    exchangeRegisters(a, reversed, swaps);
+    b = _mm256_permutevar8x32_epi32(reversed, reverse);
+}
+
+template <int N>
+NETWORK_TARGET void networkKernelAvx2(int *keys, std::uint64_t &swaps) {
+    constexpr int registers = N / 8;
+    __m256i v[registers];
+    for (int r = 0; r < registers; ++r)
+        v[r] = _mm256_load_si256((const __m256i *)(keys + 8 * r));
+
+    for (int k = 2; k <= N; k *= 2) {
+        if (k <= 8) {
+            for (int r = 0; r < registers; ++r)
+                v[r] = exchangeLanes(v[r], k - 1, k / 2, swaps);
+        } else {
+            for (int start = 0; start < registers; start += k / 8)
+                for (int c = 0; c < k / 16; ++c)
+                    exchangeMirrored(v[start + c], v[start + k / 8 - 1 - c], swaps);
+        }
+        for (int j = k / 4; j >= 1; j /= 2) {
+            if (j >= 8) {
+                for (int start = 0; start < registers; start += j / 4)
+                    for (int c = 0; c < j / 8; ++c)
+                        exchangeRegisters(v[start + c], v[start + c + j / 8], swaps);
+            } else {
+                for (int r = 0; r < registers; ++r)
+                    v[r] = exchangeLanes(v[r], j, j, swaps);
+            }
+        }
+    }
+
+    for (int r = 0; r < registers; ++r)
+        _mm256_store_si256((__m256i *)(keys + 8 * r), v[r]);
+}
+#undef NETWORK_TARGET
+#endif
+
+// Sorts the count keys from array[low] with a network of N inputs. A recorded trace gets
+// one batch per stage, holding its compares and swaps. Otherwise int keys in ascending order
+// run through the vector kernel, and any other key type through the comparator, in place.
+template <int N, typename RandomIt, typename Recorder, typename Less>
+void runNetwork(RandomIt array, int low, int count, Recorder &trace, Less less) {
+    if (trace.isKeepingSteps()) {
+        std::vector<Step> stage;
+        bitonicStages<N>([&](int i, int j) {
+            if (j >= count)
+                return;
+            int a = low + i, b = low + j;
+            stage.push_back({STEP_COMPARE, a, b});
+            if (less(array[b], array[a])) {
+                std::swap(array[a], array[b]);
+                stage.push_back({STEP_SWAP, a, b});
+            }
+        }, [&] {
+            if (!stage.empty())
+                trace.batch(stage);
+            stage.clear();
+        });
+        return;
+    }
+
+    if constexpr (!std::is_same_v<typename std::iterator_traits<RandomIt>::value_type, int> || !std::is_same_v<Less, DefaultLess>) {
+        std::uint64_t comparisons = 0, swaps = 0;
+        bitonicStages<N>([&](int i, int j) {
+            if (j >= count)
+                return;
+            comparisons++;
+            if (less(array[low + j], array[low + i])) {
+                std::swap(array[low + i], array[low + j]);
+                swaps++;
+            }
+        }, [] {});
+        trace.count(comparisons, swaps);
+    } else {
+        alignas(32) int keys[N];
+        std::copy(array + low, array + low + count, keys);
+        std::fill(keys + count, keys + N, INT_MAX);
+        std::uint64_t swaps = 0;
+#ifdef HAVE_X86_SIMD
+        static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+        if (hasAvx2)
+            networkKernelAvx2<N>(keys, swaps);
+        else
+            networkKernelScalar<N>(keys, swaps);
+#else
+        networkKernelScalar<N>(keys, swaps);
+#endif
+        std::copy(keys, keys + count, array + low);
+        // The kernel runs every comparator, padding included, so all of them are counted
+        trace.count(bitonicComparators<N>(), swaps);
+    }
+}
+
+// Base case shared by the recursive sorts: sorts [low, high] with the smallest network that
+// fits it, as long as that is no larger than networkBlock (0 turns networks off).
+// Returns false, without touching the range, when it is too large.
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+bool networkSort(RandomIt array, int low, int high, int networkBlock, Recorder &trace, Less less = Less()) {
+    int count = high - low + 1;
+    if (count > networkBlock)
+        return false;
+    if (count <= 1)
+        return true;
+    if (count <= 8)
+        runNetwork<8>(array, low, count, trace, less);
+    else if (count <= 16)
+        runNetwork<16>(array, low, count, trace, less);
+    else if (count <= 32)
+        runNetwork<32>(array, low, count, trace, less);
+    else
+        runNetwork<64>(array, low, count, trace, less);
+    return true;
+}
+
+// Sorting functions
+// The comparison sorts are templates over a random access iterator (named array, and indexed
+// like one), a recorder and a comparator. StepTrace records for the window and the benchmark;
+// NullRecorder compiles every hook away. less(x, y) orders keys the way x < y orders ints.
+//
+// Sifts node i down the heap of n elements stored from array[first] on. The heap is d-ary:
+// the children of node i are arity * i + 1 to arity * i + arity, adjacent in memory, so a
+// 4-ary or 8-ary heap reads them with mostly sequential loads (nothing aligns the groups to
+// cache lines, so a group can straddle two) and has half or a third of the levels of a
+// binary one.
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void heapify(RandomIt array, int n, int i, Recorder &trace, int first = 0, int arity = 2, Less less = Less()) {
+    while (true) {
+        int child = arity * i + 1;
+        if (child >= n)
+            return;
+        int largest = child;
+        int lastChild = std::min(child + arity, n);
+        for (int c = child + 1; c < lastChild; ++c) {
+            trace.compare(first + c, first + largest);
+            if (less(array[first + largest], array[first + c]))
+                largest = c;
+        }
+
+        trace.compare(first + largest, first + i);
+        if (!less(array[first + i], array[first + largest]))
+            return;
+        std::swap(array[first + i], array[first + largest]);
+        trace.swap(first + i, first + largest);
+        i = largest;
+    }
+}
+
+// Floyd's bottom-up sift. In the sort phase the key moved to the root came from the bottom
+// and nearly always sinks back there, so this follows the larger children down to a leaf
+// without comparing them to the key, then climbs back up to where the key belongs.
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void heapifyBottomUp(RandomIt array, int n, int i, Recorder &trace, int first = 0, int arity = 2, Less less = Less()) {
+    int j = i;
+    while (arity * j + 1 < n) {
+        int child = arity * j + 1;
+        int largest = child;
+        int lastChild = std::min(child + arity, n);
+        for (int c = child + 1; c < lastChild; ++c) {
+            trace.compare(first + c, first + largest);
+            if (less(array[first + largest], array[first + c]))
+                largest = c;
+        }
+        j = largest;
+    }
+
+    while (j != i) {
+        trace.compare(first + j, first + i);
+        if (!less(array[first + j], array[first + i]))
+            break;
+        j = (j - 1) / arity;
+    }
+
+    // The key goes to j and every key on the path above it moves up one level
+    if (j == i)
+        return;
+    auto carried = std::move(array[first + j]);
+    array[first + j] = std::move(array[first + i]);
+    trace.write(first + j, array[first + j]);
+    while (j != i) {
+        j = (j - 1) / arity;
+        std::swap(carried, array[first + j]);
+        trace.write(first + j, array[first + j]);
+    }
+}
+
+// Sorts the first n elements of array with a heap of the given arity
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void heapSort(RandomIt array, int n, Recorder &trace, int arity = 2, bool bottomUp = false, Less less = Less()) {
+    trace.range(0, n - 1);
+
+    for (int i = (n - 2) / arity; i >= 0; i--)
+        heapify(array, n, i, trace, 0, arity, less);
+
+    for (int i = n - 1; i > 0; i--) {
+        std::swap(array[0], array[i]);
+        trace.swap(0, i);
+        trace.range(0, i - 1);
+        if (bottomUp)
+            heapifyBottomUp(array, i, 0, trace, 0, arity, less);
+        else
+            heapify(array, i, 0, trace, 0, arity, less);
+    }
+}
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void bubbleSort(RandomIt array, int n, Recorder &trace, Less less = Less()) {
+    for (int i = 0; i + 1 < n; ++i) {
+        for (int j = 0; j < n - i - 1; ++j) {
+            trace.compare(j, j + 1);
+            if (less(array[j + 1], array[j])) {
+                std::swap(array[j], array[j + 1]);
+                trace.swap(j, j + 1);
+            }
+        }
+    }
+}
+
+// Lomuto partition around the median of array[low], array[mid] and array[high] (the median
+// of three such medians on larger ranges), which is moved to high first. Keys equal to the
+// pivot go to alternate sides, so a range of equal keys still splits in half. Kept out of
+// line so quickSort's frame stays small.
+const int QUICK_SORT_NINTHER_THRESHOLD = 128;
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+[[gnu::noinline]] int partition(RandomIt array, int low, int high, Recorder &trace, Less less = Less()) {
+    trace.range(low, high);
+    if (high - low >= 2) {
+        auto order = [&](int a, int b) {
+            trace.compare(a, b);
+            if (less(array[b], array[a])) {
+                std::swap(array[a], array[b]);
+                trace.swap(a, b);
+            }
+        };
+        auto median = [&](int a, int b, int c) {
+            order(a, b);
+            order(b, c);
+            order(a, b);
+        };
+        int mid = low + (high - low) / 2;
+        if (high - low >= QUICK_SORT_NINTHER_THRESHOLD) {
+            int step = (high - low) / 8;
+            median(low, low + step, low + 2 * step);
+            median(mid - step, mid, mid + step);
+            median(high - 2 * step, high - step, high);
+            median(low + step, mid, high - step);
+        } else {
+            median(low, mid, high);
+        }
+        std::swap(array[mid], array[high]);
+        trace.swap(mid, high);
+    }
+    auto pivot = array[high];
+    int i = low - 1;
+    trace.pivot(high);
+
+    bool equalLeft = false;
+    for (int j = low; j <= high - 1; j++) {
+        trace.compare(j, high);
+        if (less(array[j], pivot) || (!less(pivot, array[j]) && (equalLeft = !equalLeft))) {
+            i++;
+            std::swap(array[i], array[j]);
+            trace.swap(i, j);
+        }
+    }
+
+    std::swap(array[i + 1], array[high]);
+    trace.swap(i + 1, high);
+    return i+1;
+}
+
+// Recurses into the smaller side and loops on the larger one, so the stack stays O(log n) deep
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void quickSort(RandomIt array, int low, int high, Recorder &trace, int networkBlock = 0, Less less = Less()) {
+    while (low < high && !networkSort(array, low, high, networkBlock, trace, less)) {
+        int pi = partition(array, low, high, trace, less);
+        if (pi - low < high - pi) {
+            quickSort(array, low, pi - 1, trace, networkBlock, less);
+            low = pi + 1;
+        } else {
+            quickSort(array, pi + 1, high, trace, networkBlock, less);
+            high = pi - 1;
+        }
+    }
+}
+
+
+
+// Merges array[left, mid] and array[mid + 1, right]. Both runs are first moved into the
+// same positions of scratch, a buffer as large as the whole array that every merge reuses.
+template <typename RandomIt, typename ScratchIt, typename Recorder, typename Less = DefaultLess>
+void merge(RandomIt array, ScratchIt scratch, int left, int mid, int right, Recorder &trace, Less less = Less()) {
+    std::move(array + left, array + right + 1, scratch + left);
+
+    int i = left, j = mid + 1, k = left;
+    trace.range(left, right);
+
+    while (i <= mid && j <= right) {
+        trace.compare(i, j);
+        if (!less(scratch[j], scratch[i])) {
+            array[k] = std::move(scratch[i]);
+            i++;
+        } else {
+            array[k] = std::move(scratch[j]);
+            j++;
+        }
+        trace.write(k, array[k]);
+        k++;
+    }
+
+    while (i <= mid) {
+        array[k] = std::move(scratch[i]);
+        trace.write(k, array[k]);
+        i++;
+        k++;
+    }
+
+    while (j <= right) {
+        array[k] = std::move(scratch[j]);
+        trace.write(k, array[k]);
+        j++;
+        k++;
+    }
+}
+
+template <typename RandomIt, typename ScratchIt, typename Recorder, typename Less = DefaultLess>
+void mergeSort(RandomIt array, ScratchIt scratch, int left, int right, Recorder &trace, int networkBlock = 0, Less less = Less()) {
+    if (left < right && !networkSort(array, left, right, networkBlock, trace, less)) {
+        int mid = left + (right - left) / 2;
+
+        mergeSort(array, scratch, left, mid, trace, networkBlock, less);
+        mergeSort(array, scratch, mid + 1, right, trace, networkBlock, less);
+        merge(array, scratch, left, mid, right, trace, less);
+    }
+}
+
+// Sorts array[left, right]; the scratch buffer covers array[0, right]
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void mergeSort(RandomIt array, int left, int right, Recorder &trace, int networkBlock = 0, Less less = Less()) {
+    using Key = typename std::iterator_traits<RandomIt>::value_type;
+    std::vector<Key> scratch(std::max(right + 1, 0));
+    trace.allocate(scratch.size() * sizeof(Key));
+    mergeSort(array, scratch.begin(), left, right, trace, networkBlock, less);
+    trace.release(scratch.size() * sizeof(Key));
+}
+
+// Merges source[left, mid] and source[mid + 1, right] into the same positions of target
+template <typename SourceIt, typename TargetIt, typename Recorder, typename Less = DefaultLess>
+void mergeInto(SourceIt source, TargetIt target, int left, int mid, int right, Recorder &trace, Less less = Less()) {
+    int i = left, j = mid + 1, k = left;
+    trace.range(left, right);
+
+    while (i <= mid && j <= right) {
+        trace.compare(i, j);
+        target[k] = !less(source[j], source[i]) ? std::move(source[i++]) : std::move(source[j++]);
+        trace.write(k, target[k]);
+        k++;
+    }
+    while (i <= mid) {
+        target[k] = std::move(source[i++]);
+        trace.write(k, target[k]);
+        k++;
+    }
+    while (j <= right) {
+        target[k] = std::move(source[j++]);
+        trace.write(k, target[k]);
+        k++;
+    }
+}
+
+// Bottom-up merge sort: merges runs of 1, 2, 4, ... elements, alternating between the array
+// and one scratch buffer so nothing is ever copied back. When the number of passes is odd
+// the first one sorts pairs in place, so the last pass always lands in the array.
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void bottomUpMergeSort(RandomIt array, int n, Recorder &trace, Less less = Less()) {
+    using Key = typename std::iterator_traits<RandomIt>::value_type;
+    int passes = 0;
+    for (int width = 1; width < n; width *= 2)
+        passes++;
+
+    int width = 1;
+    if (passes % 2 == 1) {
+        for (int i = 0; i + 1 < n; i += 2) {
+            trace.compare(i, i + 1);
+            if (less(array[i + 1], array[i])) {
+                std::swap(array[i], array[i + 1]);
+                trace.swap(i, i + 1);
+            }
+        }
+        width = 2;
+    }
+
+    std::vector<Key> scratch(n);
+    trace.allocate(scratch.size() * sizeof(Key));
+    auto mergePass = [&](auto source, auto target) {
+        for (int left = 0; left < n; left += 2 * width) {
+            int mid = std::min(left + width - 1, n - 1);
+            int right = std::min(left + 2 * width - 1, n - 1);
+            mergeInto(source, target, left, mid, right, trace, less);
+        }
+    };
+    for (bool fromArray = true; width < n; width *= 2, fromArray = !fromArray) {
+        if (fromArray)
+            mergePass(array, scratch.begin());
+        else
+            mergePass(scratch.begin(), array);
+    }
+    trace.release(scratch.size() * sizeof(Key));
+}
+
+// Tim sort: a natural merge sort. The array is cut into the runs it already has: ascending
+// ones are kept, strictly descending ones reversed in place, and runs shorter than minrun
+// are extended to it by binary insertion. Pending runs wait on a stack whose lengths have to
+// shrink faster than the Fibonacci numbers; a push that breaks this merges runs near the top,
+// so the stack stays O(log n) deep and merges stay balanced. A merge only moves the shorter
+// run into a scratch buffer of n / 2 elements allocated once, and switches to galloping
+// (exponential search) while one run keeps winning. Sorted input is one run, n - 1 compares.
+// Every detected run and every merge result is recorded as a run step for the display.
+const int TIM_SORT_MIN_MERGE = 64;
+const int TIM_SORT_MIN_GALLOP = 7;
+
+// n itself below TIM_SORT_MIN_MERGE, otherwise a length between 32 and 64 such that n / minrun
+// is a power of two or just below one
+inline int timSortMinRun(int n) {
+    int roundUp = 0;
+    while (n >= TIM_SORT_MIN_MERGE) {
+        roundUp |= n & 1;
+        n >>= 1;
+    }
+    return n + roundUp;
+}
+
+// Finds where key belongs in the sorted range[0, length): the number of elements less than
+// key, or with right set, not greater than it (so key goes after its equals). Probes hint,
+// then hint +- 1, 3, 7, ... before a binary search, costing O(log d) when the answer is d
+// away from hint. keyIndex and rangeIndex are the array positions recorded for compares.
+template <typename Key, typename It, typename Recorder, typename Less>
+int gallop(const Key &key, int keyIndex, It range, int rangeIndex, int length, int hint, bool right, Recorder &trace, Less less) {
+    auto before = [&](int i) {
+        trace.compare(keyIndex, rangeIndex + i);
+        return right ? !less(key, range[i]) : less(range[i], key);
+    };
+    // The answer ends up in (lastOffset, offset]
+    int lastOffset = 0, offset = 1;
+    if (before(hint)) {
+        int maxOffset = length - hint;
+        while (offset < maxOffset && before(hint + offset)) {
+            lastOffset = offset;
+            offset = offset * 2 + 1;
+            if (offset <= 0)
+                offset = maxOffset;
+        }
+        offset = std::min(offset, maxOffset);
+        lastOffset += hint;
+        offset += hint;
+    } else {
+        int maxOffset = hint + 1;
+        while (offset < maxOffset && !before(hint - offset)) {
+            lastOffset = offset;
+            offset = offset * 2 + 1;
+            if (offset <= 0)
+                offset = maxOffset;
+        }
+        offset = std::min(offset, maxOffset);
+        int nearer = lastOffset;
+        lastOffset = hint - offset;
+        offset = hint - nearer;
+    }
+    lastOffset++;
+    while (lastOffset < offset) {
+        int mid = lastOffset + (offset - lastOffset) / 2;
+        if (before(mid))
+            lastOffset = mid + 1;
+        else
+            offset = mid;
+    }
+    return offset;
+}
+
+template <typename RandomIt, typename Recorder, typename Less>
+class TimSorter {
+public:
+    using Key = typename std::iterator_traits<RandomIt>::value_type;
+
+    TimSorter(RandomIt array, int n, Recorder &trace, Less less) : array(array), n(n), trace(trace), less(less), scratch(n / 2) {
+        trace.allocate(scratch.size() * sizeof(Key));
+    }
+    ~TimSorter() { trace.release(scratch.size() * sizeof(Key)); }
+
+    void sort() {
+        int minRun = timSortMinRun(n);
+        for (int low = 0; low < n;) {
+            int end = countRun(low);
+            if (end - low < minRun) {
+                int forced = std::min(n, low + minRun);
+                binaryInsertionSort(low, forced, end);
+                end = forced;
+            }
+            trace.run(low, end - 1);
+            runBase.push_back(low);
+            runLength.push_back(end - low);
+            mergeCollapse();
+            low = end;
+        }
+        while (runBase.size() > 1) {
+            int i = runBase.size() - 2;
+            if (i > 0 && runLength[i - 1] < runLength[i + 1])
+                i--;
+            mergeAt(i);
+        }
+    }
+
+private:
+    // Returns the end of the run starting at low, reversing it first if it is strictly
+    // descending (strictly, so that reversing cannot reorder equal keys)
+    int countRun(int low) {
+        int end = low + 1;
+        if (end == n)
+            return end;
+        trace.compare(end, low);
+        if (less(array[end], array[low])) {
+            for (end++; end < n; end++) {
+                trace.compare(end, end - 1);
+                if (!less(array[end], array[end - 1]))
+                    break;
+            }
+            for (int i = low, j = end - 1; i < j; i++, j--) {
+                std::swap(array[i], array[j]);
+                trace.swap(i, j);
+            }
+        } else {
+            for (end++; end < n; end++) {
+                trace.compare(end, end - 1);
+                if (less(array[end], array[end - 1]))
+                    break;
+            }
+        }
+        return end;
+    }
+
+    // Sorts [low, high) given that [low, start) already is, finding each insertion point
+    // with a binary search
+    void binaryInsertionSort(int low, int high, int start) {
+        for (int i = start; i < high; i++) {
+            Key pivot = std::move(array[i]);
+            int left = low, right = i;
+            while (left < right) {
+                int mid = left + (right - left) / 2;
+                trace.compare(i, mid);
+                if (less(pivot, array[mid]))
+                    right = mid;
+                else
+                    left = mid + 1;
+            }
+            for (int j = i; j > left; j--) {
+                array[j] = std::move(array[j - 1]);
+                trace.write(j, array[j]);
+            }
+            array[left] = std::move(pivot);
+            if (left != i)
+                trace.write(left, array[left]);
+        }
+    }
+
+    // Merges until, for the runs X, Y, Z on top of the stack, |Z| > |Y| + |X| and |Y| > |X|.
+    // The first condition is also checked one run further down, which the original
+    // formulation missed.
+    void mergeCollapse() {
+        while (runBase.size() > 1) {
+            int i = runBase.size() - 2;
+            if ((i > 0 && runLength[i - 1] <= runLength[i] + runLength[i + 1]) || (i > 1 && runLength[i - 2] <= runLength[i - 1] + runLength[i])) {
+                if (runLength[i - 1] < runLength[i + 1])
+                    i--;
+            } else if (runLength[i] > runLength[i + 1]) {
+                break;
+            }
+            mergeAt(i);
+        }
+    }
+
+    // Merges runs i and i + 1 of the stack. Elements of the first run that are not greater
+    // than the second run's first element, and elements of the second run not less than the
+    // first run's last one, are already in place; only the rest is merged.
+    void mergeAt(int i) {
+        int base1 = runBase[i], length1 = runLength[i];
+        int base2 = runBase[i + 1], length2 = runLength[i + 1];
+        runLength[i] = length1 + length2;
+        runBase.erase(runBase.begin() + i + 1);
+        runLength.erase(runLength.begin() + i + 1);
+        trace.range(base1, base2 + length2 - 1);
+
+        int skip = gallop(array[base2], base2, array + base1, base1, length1, 0, true, trace, less);
+        base1 += skip;
+        length1 -= skip;
+        if (length1 > 0)
+            length2 = gallop(array[base1 + length1 - 1], base1 + length1 - 1, array + base2, base2, length2, length2 - 1, false, trace, less);
+        if (length1 > 0 && length2 > 0) {
+            if (length1 <= length2)
+                mergeLow(base1, length1, base2, length2);
+            else
+                mergeHigh(base1, length1, base2, length2);
+        }
+        trace.run(runBase[i], runBase[i] + runLength[i] - 1);
+    }
+
+    // Merges from the left, with the first (shorter) run moved out into scratch
+    void mergeLow(int base1, int length1, int base2, int length2) {
+        std::move(array + base1, array + base1 + length1, scratch.begin());
+        int cursor1 = 0, cursor2 = base2, dest = base1;
+        auto takeFirst = [&](int count) {
+            for (; count > 0; count--, length1--) {
+                array[dest] = std::move(scratch[cursor1++]);
+                trace.write(dest, array[dest]);
+                dest++;
+            }
+        };
+        auto takeSecond = [&](int count) {
+            for (; count > 0; count--, length2--) {
+                array[dest] = std::move(array[cursor2++]);
+                trace.write(dest, array[dest]);
+                dest++;
+            }
+        };
+
+        while (length1 > 0 && length2 > 0) {
+            // One element at a time until a run wins minGallop times in a row
+            int wins1 = 0, wins2 = 0;
+            while (length1 > 0 && length2 > 0 && wins1 < minGallop && wins2 < minGallop) {
+                trace.compare(base1 + cursor1, cursor2);
+                if (less(array[cursor2], scratch[cursor1])) {
+                    takeSecond(1);
+                    wins2++;
+                    wins1 = 0;
+                } else {
+                    takeFirst(1);
+                    wins1++;
+                    wins2 = 0;
+                }
+            }
+            // Then whole stretches found by galloping, for as long as they stay long
+            while (length1 > 0 && length2 > 0) {
+                wins1 = gallop(array[cursor2], cursor2, scratch.begin() + cursor1, base1 + cursor1, length1, 0, true, trace, less);
+                takeFirst(wins1);
+                if (length1 == 0)
+                    break;
+                takeSecond(1);
+                if (length2 == 0)
+                    break;
+                wins2 = gallop(scratch[cursor1], base1 + cursor1, array + cursor2, cursor2, length2, 0, false, trace, less);
+                takeSecond(wins2);
+                if (length2 == 0)
+                    break;
+                takeFirst(1);
+                minGallop = std::max(minGallop - 1, 1);
+                if (wins1 < TIM_SORT_MIN_GALLOP && wins2 < TIM_SORT_MIN_GALLOP) {
+                    minGallop += 2;
+                    break;
+                }
+            }
+        }
+        takeFirst(length1);
+    }
+
+    // Merges from the right, with the second (shorter) run moved out into scratch
+    void mergeHigh(int base1, int length1, int base2, int length2) {
+        std::move(array + base2, array + base2 + length2, scratch.begin());
+        int cursor1 = base1 + length1 - 1, cursor2 = length2 - 1, dest = base2 + length2 - 1;
+        auto takeFirst = [&](int count) {
+            for (; count > 0; count--, length1--) {
+                array[dest] = std::move(array[cursor1--]);
+                trace.write(dest, array[dest]);
+                dest--;
+            }
+        };
+        auto takeSecond = [&](int count) {
+            for (; count > 0; count--, length2--) {
+                array[dest] = std::move(scratch[cursor2--]);
+                trace.write(dest, array[dest]);
+                dest--;
+            }
+        };
+
+        while (length1 > 0 && length2 > 0) {
+            int wins1 = 0, wins2 = 0;
+            while (length1 > 0 && length2 > 0 && wins1 < minGallop && wins2 < minGallop) {
+                trace.compare(cursor1, base2 + cursor2);
+                if (less(scratch[cursor2], array[cursor1])) {
+                    takeFirst(1);
+                    wins1++;
+                    wins2 = 0;
+                } else {
+                    takeSecond(1);
+                    wins2++;
+                    wins1 = 0;
+                }
+            }
+            while (length1 > 0 && length2 > 0) {
+                wins1 = length1 - gallop(scratch[cursor2], base2 + cursor2, array + base1, base1, length1, length1 - 1, true, trace, less);
+                takeFirst(wins1);
+                if (length1 == 0)
+                    break;
+                takeSecond(1);
+                if (length2 == 0)
+                    break;
+                wins2 = length2 - gallop(array[cursor1], cursor1, scratch.begin(), base2, length2, length2 - 1, false, trace, less);
+                takeSecond(wins2);
+                if (length2 == 0)
+                    break;
+                takeFirst(1);
+                minGallop = std::max(minGallop - 1, 1);
+                if (wins1 < TIM_SORT_MIN_GALLOP && wins2 < TIM_SORT_MIN_GALLOP) {
+                    minGallop += 2;
+                    break;
+                }
+            }
+        }
+        takeSecond(length2);
+    }
+
+    RandomIt array;
+    int n;
+    Recorder &trace;
+    Less less;
+    std::vector<Key> scratch;
+    std::vector<int> runBase, runLength; // the stack of runs waiting to be merged
+    int minGallop = TIM_SORT_MIN_GALLOP; // lowered while galloping pays off, raised when it does not
+};
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void timSort(RandomIt array, int n, Recorder &trace, Less less = Less()) {
+    if (n < 2)
+        return;
+    TimSorter<RandomIt, Recorder, Less>(array, n, trace, less).sort();
+}
+
+
+
+// Introsort with the pattern tricks of pdqsort: a median-of-three pivot (ninther above
+// 128 elements), insertion sort below 24 elements, heap sort once the recursion gets
+// deeper than 2 log2(n), and an early exit when a partition finds its range already sorted.
+const int INSERTION_SORT_THRESHOLD = 24;
+const int NINTHER_THRESHOLD = 128;
+const int PARTIAL_INSERTION_SORT_LIMIT = 8;
+
+// Swaps array[a] and array[b] if they are out of order
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void sortTwo(RandomIt array, int a, int b, Recorder &trace, Less less = Less()) {
+    trace.compare(a, b);
+    if (less(array[b], array[a])) {
+        std::swap(array[a], array[b]);
+        trace.swap(a, b);
+    }
+}
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void sortThree(RandomIt array, int a, int b, int c, Recorder &trace, Less less = Less()) {
+    sortTwo(array, a, b, trace, less);
+    sortTwo(array, b, c, trace, less);
+    sortTwo(array, a, b, trace, less);
+}
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void insertionSort(RandomIt array, int low, int high, Recorder &trace, Less less = Less()) {
+    for (int i = low + 1; i <= high; i++) {
+        auto value = std::move(array[i]);
+        int j = i;
+        while (j > low) {
+            trace.compare(j - 1, i);
+            if (!less(value, array[j - 1]))
+                break;
+            array[j] = std::move(array[j - 1]);
+            trace.write(j, array[j]);
+            j--;
+        }
+        array[j] = std::move(value);
+        if (j != i)
+            trace.write(j, array[j]);
+    }
+}
+
+// Insertion sort that gives up once it has moved more than PARTIAL_INSERTION_SORT_LIMIT
+// elements. Returns whether [low, high] ended up sorted.
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+bool partialInsertionSort(RandomIt array, int low, int high, Recorder &trace, Less less = Less()) {
+    int moved = 0;
+    for (int i = low + 1; i <= high; i++) {
+        auto value = std::move(array[i]);
+        int j = i;
+        while (j > low) {
+            trace.compare(j - 1, i);
+            if (!less(value, array[j - 1]))
+                break;
+            array[j] = std::move(array[j - 1]);
+            trace.write(j, array[j]);
+            j--;
+        }
+        array[j] = std::move(value);
+        if (j != i) {
+            trace.write(j, array[j]);
+            moved += i - j;
+            if (moved > PARTIAL_INSERTION_SORT_LIMIT)
+                return false;
+        }
+    }
+    return true;
+}
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void heapSortRange(RandomIt array, int low, int high, Recorder &trace, Less less = Less()) {
+    int n = high - low + 1;
+    for (int i = n / 2 - 1; i >= 0; i--)
+        heapify(array, n, i, trace, low, 2, less);
+    for (int i = n - 1; i > 0; i--) {
+        std::swap(array[low], array[low + i]);
+        trace.swap(low, low + i);
+        heapify(array, i, 0, trace, low, 2, less);
+    }
+}
+
+// Partitions [low, high] around the pivot stored in array[low]: keys smaller than the pivot
+// go left, the rest right. Returns the final pivot position; alreadyPartitioned is set when
+// no element had to move, which usually means the range is sorted.
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+int partitionRight(RandomIt array, int low, int high, bool &alreadyPartitioned, Recorder &trace, Less less = Less()) {
+    auto pivot = array[low];
+    int first = low;
+    int last = high + 1;
+    trace.pivot(low);
+
+    // The pivot selection left a key >= pivot further right, so this scan stops
+    do {
+        first++;
+        trace.compare(first, low);
+    } while (less(array[first], pivot));
+
+    if (first - 1 == low) {
+        while (first < last) {
+            last--;
+            trace.compare(last, low);
+            if (less(array[last], pivot))
+                break;
+        }
+    } else {
+        do {
+            last--;
+            trace.compare(last, low);
+        } while (!less(array[last], pivot));
+    }
+
+    alreadyPartitioned = first >= last;
+    while (first < last) {
+        std::swap(array[first], array[last]);
+        trace.swap(first, last);
+        do {
+            first++;
+            trace.compare(first, low);
+        } while (less(array[first], pivot));
+        do {
+            last--;
+            trace.compare(last, low);
+        } while (!less(array[last], pivot));
+    }
+
+    int pivotPosition = first - 1;
+    if (pivotPosition != low) {
+        std::swap(array[low], array[pivotPosition]);
+        trace.swap(low, pivotPosition);
+    }
+    return pivotPosition;
+}
+
+// Like partitionRight, but keys equal to the pivot go left. Used when the pivot equals the
+// key just before the range, so that whole run of equal keys is finished in one pass.
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+int partitionLeft(RandomIt array, int low, int high, Recorder &trace, Less less = Less()) {
+    auto pivot = array[low];
+    int first = low;
+    int last = high + 1;
+    trace.pivot(low);
+
+    do {
+        last--;
+        trace.compare(last, low);
+    } while (less(pivot, array[last]));
+
+    if (last + 1 == high + 1) {
+        while (first < last) {
+            first++;
+            trace.compare(first, low);
+            if (less(pivot, array[first]))
+                break;
+        }
+    } else {
+        do {
+            first++;
+            trace.compare(first, low);
+        } while (!less(pivot, array[first]));
+    }
+
+    while (first < last) {
+        std::swap(array[first], array[last]);
+        trace.swap(first, last);
+        do {
+            last--;
+            trace.compare(last, low);
+        } while (less(pivot, array[last]));
+        do {
+            first++;
+            trace.compare(first, low);
+        } while (!less(pivot, array[first]));
+    }
+
+    if (last != low) {
+        std::swap(array[low], array[last]);
+        trace.swap(low, last);
+    }
+    return last;
+}
+
+// leftmost tells whether there is a key before low that is known to be <= every key in the range
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void introSort(RandomIt array, int low, int high, int depthLimit, bool leftmost, Recorder &trace, int networkBlock = 0, Less less = Less()) {
+    while (true) {
+        int size = high - low + 1;
+        if (size > 1 && size <= networkBlock) {
+            trace.range(low, high);
+            networkSort(array, low, high, networkBlock, trace, less);
+            return;
+        }
+        if (size <= INSERTION_SORT_THRESHOLD) {
+            if (size > 1) {
+                trace.range(low, high);
+                insertionSort(array, low, high, trace, less);
+            }
+            return;
+        }
+        trace.range(low, high);
+
+        if (depthLimit == 0) {
+            heapSortRange(array, low, high, trace, less);
+            return;
+        }
+        depthLimit--;
+
+        // Move the pivot to array[low]
+        int mid = low + size / 2;
+        if (size > NINTHER_THRESHOLD) {
+            sortThree(array, low, mid, high, trace, less);
+            sortThree(array, low + 1, mid - 1, high - 1, trace, less);
+            sortThree(array, low + 2, mid + 1, high - 2, trace, less);
+            sortThree(array, mid - 1, mid, mid + 1, trace, less);
+            std::swap(array[low], array[mid]);
+            trace.swap(low, mid);
+        } else {
+            sortThree(array, mid, low, high, trace, less);
+        }
+
+        // A pivot equal to the key before the range means every key equal to it belongs here
+        if (!leftmost) {
+            trace.compare(low - 1, low);
+            if (!less(array[low - 1], array[low])) {
+                low = partitionLeft(array, low, high, trace, less) + 1;
+                continue;
+            }
+        }
+
+        bool alreadyPartitioned;
+        int pivotPosition = partitionRight(array, low, high, alreadyPartitioned, trace, less);
+
+        // Nothing moved: the range is probably sorted already, so try to finish it cheaply
+        if (alreadyPartitioned) {
+            bool leftSorted = pivotPosition - 1 <= low || partialInsertionSort(array, low, pivotPosition - 1, trace, less);
+            bool rightSorted = pivotPosition + 1 >= high || partialInsertionSort(array, pivotPosition + 1, high, trace, less);
+            if (leftSorted && rightSorted)
+                return;
+        }
+
+        // Recurse into the smaller side and loop on the larger one, so the stack stays O(log n)
+        if (pivotPosition - low < high - pivotPosition) {
+            introSort(array, low, pivotPosition - 1, depthLimit, leftmost, trace, networkBlock, less);
+            low = pivotPosition + 1;
+            leftmost = false;
+        } else {
+            introSort(array, pivotPosition + 1, high, depthLimit, false, trace, networkBlock, less);
+            high = pivotPosition - 1;
+        }
+    }
+}
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void introSort(RandomIt array, int n, Recorder &trace, int networkBlock = 0, Less less = Less()) {
+    int depthLimit = 2 * (int)std::log2(std::max(n, 1));
+    introSort(array, 0, n - 1, depthLimit, true, trace, networkBlock, less);
+}
+
+
+
+template <typename RandomIt, typename Recorder, typename Less = DefaultLess>
+void selectionSort(RandomIt array, int n, Recorder &trace, Less less = Less()) {
+    for (int i = 0; i < n - 1; i++) {
+        int minIndex = i;
+        trace.pivot(i);
+        for (int j = i + 1; j < n; j++) {
+            trace.compare(j, minIndex);
+            if (less(array[j], array[minIndex])) {
+                minIndex = j;
+            }
+        }
+        std::swap(array[minIndex], array[i]);
+        trace.swap(minIndex, i);
+    }
+}
+
+// Radix and counting sorts
+// Keys are the values with their sign bit flipped, so negative numbers order before positive
+// ones when compared as unsigned. Every digit pass starts with a histogram of the digits;
+// on x86-64 the digits are extracted 8 (AVX2) or 4 (SSE2) at a time, picked at run time.
+const std::uint32_t SIGN_BIAS = 0x80000000u;
+const int MSD_INSERTION_SORT_THRESHOLD = 32;
+
+inline std::uint32_t radixDigit(int value, std::uint32_t bias, int shift, std::uint32_t mask) {
+    return (((std::uint32_t)value - bias) >> shift) & mask;
+}
+
+// Adds the digit of every element of data[0, n) to counts
+void histogramScalar(const int *data, size_t n, std::uint32_t bias, int shift, std::uint32_t mask, std::uint32_t *counts) {
+    for (size_t i = 0; i < n; ++i)
+        counts[radixDigit(data[i], bias, shift, mask)]++;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+void histogramAvx2(const int *data, size_t n, std::uint32_t bias, int shift, std::uint32_t mask, std::uint32_t *counts) {
+    const __m256i biasVector = _mm256_set1_epi32((int)bias);
+    const __m256i maskVector = _mm256_set1_epi32((int)mask);
+    const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+    alignas(32) std::uint32_t digits[8];
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i keys = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(data + i)), biasVector);
+        _mm256_store_si256((__m256i *)digits, _mm256_and_si256(_mm256_srl_epi32(keys, shiftCount), maskVector));
+        for (int k = 0; k < 8; ++k)
+            counts[digits[k]]++;
+    }
+    histogramScalar(data + i, n - i, bias, shift, mask, counts);
+}
+
+void histogramSse2(const int *data, size_t n, std::uint32_t bias, int shift, std::uint32_t mask, std::uint32_t *counts) {
+    const __m128i biasVector = _mm_set1_epi32((int)bias);
+    const __m128i maskVector = _mm_set1_epi32((int)mask);
+    const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+    alignas(16) std::uint32_t digits[4];
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i keys = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(data + i)), biasVector);
+        _mm_store_si128((__m128i *)digits, _mm_and_si128(_mm_srl_epi32(keys, shiftCount), maskVector));
+        counts[digits[0]]++;
+        counts[digits[1]]++;
+        counts[digits[2]]++;
+        counts[digits[3]]++;
+    }
+    histogramScalar(data + i, n - i, bias, shift, mask, counts);
+}
+#endif
+
+void histogram(const int *data, size_t n, std::uint32_t bias, int shift, std::uint32_t mask, std::uint32_t *counts) {
+#ifdef HAVE_X86_SIMD
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2) {
+        histogramAvx2(data, n, bias, shift, mask, counts);
+    } else {
+        histogramSse2(data, n, bias, shift, mask, counts);
+    }
+#else
+    histogramScalar(data, n, bias, shift, mask, counts);
+#endif
+}
+
+// LSD radix sort with digits of digitBits bits. Each pass scatters the elements into their
+// buckets in a second buffer, and the two buffers swap roles; passes where every element
+// has the same digit are skipped. Scatters are recorded as writes to the bucket slots.
+void radixSortLSD(std::vector<int> &array, int digitBits, StepTrace &trace) {
+    const size_t n = array.size();
+    const std::uint32_t mask = (1u << digitBits) - 1;
+    std::vector<int> buffer(n);
+    std::vector<std::uint32_t> counts(mask + 1);
+    trace.allocate(buffer.size() * sizeof(int) + counts.size() * sizeof(std::uint32_t));
+
+    std::vector<int> *source = &array, *target = &buffer;
+    for (int shift = 0; shift < 32; shift += digitBits) {
+        std::fill(counts.begin(), counts.end(), 0);
+        histogram(source->data(), n, SIGN_BIAS, shift, mask, counts.data());
+        if (counts[radixDigit((*source)[0], SIGN_BIAS, shift, mask)] == n)
+            continue;
+
+        std::uint32_t offset = 0;
+        for (std::uint32_t &count : counts) {
+            std::uint32_t bucketSize = count;
+            count = offset;
+            offset += bucketSize;
+        }
+
+        trace.range(0, n - 1);
+        for (size_t i = 0; i < n; ++i) {
+            int value = (*source)[i];
+            std::uint32_t slot = counts[radixDigit(value, SIGN_BIAS, shift, mask)]++;
+            (*target)[slot] = value;
+            trace.write(slot, value);
+        }
+        std::swap(source, target);
+    }
+
+    if (source != &array) {
+        for (size_t i = 0; i < n; ++i) {
+            array[i] = buffer[i];
+            trace.write(i, array[i]);
+        }
+    }
+    trace.release(buffer.size() * sizeof(int) + counts.size() * sizeof(std::uint32_t));
+}
+
+// MSD radix sort on bytes, permuting in place American flag style: every element is swapped
+// straight into the next free slot of its bucket. Buckets are then sorted on the next byte,
+// and small ones with insertion sort.
+void americanFlagSort(std::vector<int> &array, int low, int high, int shift, StepTrace &trace, int networkBlock = 0) {
+    if (networkSort(array.begin(), low, high, networkBlock, trace))
+        return;
+    if (high - low + 1 <= MSD_INSERTION_SORT_THRESHOLD) {
+        insertionSort(array.begin(), low, high, trace);
+        return;
+    }
+
+    std::uint32_t counts[256] = {};
+    histogram(array.data() + low, high - low + 1, SIGN_BIAS, shift, 0xFF, counts);
+
+    int heads[256], ends[256];
+    int offset = low;
+    for (int b = 0; b < 256; ++b) {
+        heads[b] = offset;
+        offset += counts[b];
+        ends[b] = offset;
+    }
+
+    trace.range(low, high);
+    for (int b = 0; b < 256; ++b) {
+        while (heads[b] < ends[b]) {
+            std::uint32_t digit = radixDigit(array[heads[b]], SIGN_BIAS, shift, 0xFF);
+            if ((int)digit == b) {
+                heads[b]++;
+            } else {
+                std::swap(array[heads[b]], array[heads[digit]]);
+                trace.swap(heads[b], heads[digit]);
+                heads[digit]++;
+            }
+        }
+    }
+
+    if (shift == 0)
+        return;
+    int start = low;
+    for (int b = 0; b < 256; ++b) {
+        if (ends[b] - start > 1)
+            americanFlagSort(array, start, ends[b] - 1, shift - 8, trace, networkBlock);
+        start = ends[b];
+    }
+}
+
+// Counting sort, for arrays whose values span at most COUNTING_SORT_MAX_RANGE or 4n values.
+// Wider ranges would need a huge count table, so they go to the 16-bit LSD radix sort instead.
+const std::int64_t COUNTING_SORT_MAX_RANGE = 1 << 24;
+
+// Whether countingSort hands array to the LSD radix sort, so reports can say what really ran
+bool countingSortFallsBack(const std::vector<int> &array) {
+    auto [minIt, maxIt] = std::minmax_element(array.begin(), array.end());
+    std::int64_t range = (std::int64_t)*maxIt - *minIt + 1;
+    return range > std::max<std::int64_t>(COUNTING_SORT_MAX_RANGE, 4 * (std::int64_t)array.size());
+}
+
+void countingSort(std::vector<int> &array, StepTrace &trace) {
+    if (array.empty())
+        return;
+    if (countingSortFallsBack(array)) {
+        radixSortLSD(array, 16, trace);
+        return;
+    }
+    auto [minIt, maxIt] = std::minmax_element(array.begin(), array.end());
+    std::int64_t range = (std::int64_t)*maxIt - *minIt + 1;
+
+    int minValue = *minIt;
+    std::vector<std::uint32_t> counts(range);
+    trace.allocate(counts.size() * sizeof(std::uint32_t));
+    histogram(array.data(), array.size(), (std::uint32_t)minValue, 0, 0xFFFFFFFFu, counts.data());
+
+    size_t k = 0;
+    for (std::int64_t v = 0; v < range; ++v) {
+        int value = (int)(minValue + v);
+        for (std::uint32_t c = counts[v]; c > 0; --c) {
+            array[k] = value;
+            trace.write(k, value);
+            ++k;
+        }
+    }
+    trace.release(counts.size() * sizeof(std::uint32_t));
+}
+
+// Parallel sorting
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops its own tasks
+// at the back and, once it runs dry, steals from the front of the other deques. The thread
+// that starts a sort owns the last deque and runs tasks too while it waits for them.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads) : queues(threads + 1) {
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    // One slot per worker plus one for the thread that owns the pool
+    size_t slots() const { return queues.size(); }
+    size_t currentSlot() const { return workerIndex >= 0 ? workerIndex : queues.size() - 1; }
+
+    void submit(std::function<void()> task) {
+        Queue &queue = queues[currentSlot()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        queued.fetch_add(1);
+        wake.notify_one();
+    }
+
+    // Runs one pending task, its own if there is one, otherwise a stolen one
+    bool runPendingTask() {
+        std::function<void()> task;
+        size_t own = currentSlot();
+        if (!take(own, task, false)) {
+            bool stolen = false;
+            for (size_t offset = 1; offset < queues.size() && !stolen; ++offset)
+                stolen = take((own + offset) % queues.size(), task, true);
+            if (!stolen)
+                return false;
+        }
+        queued.fetch_sub(1);
+        task();
+        return true;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool take(size_t index, std::function<void()> &task, bool fromFront) {
+        Queue &queue = queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        if (fromFront) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+
+    void workerLoop(int index) {
+        workerIndex = index;
+        while (true) {
+            if (runPendingTask())
+                continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait_for(lock, std::chrono::milliseconds(1), [this] { return stopping || queued.load() > 0; });
+            if (stopping)
+                return;
+        }
+    }
+
+    static thread_local int workerIndex;
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> queued{0};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+thread_local int ThreadPool::workerIndex = -1;
+
+// Thrown from inside a sort to abandon it
+struct SortCancelled {};
+
+// Fork/join on top of the pool: wait() keeps running tasks until the group's tasks are done.
+// A task that throws SortCancelled makes wait() throw it too. The destructor also waits, so
+// a group left by an exception never outlives the tasks that captured its frame.
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool &pool) : pool(pool) {}
+    ~TaskGroup() { finish(); }
+
+    void run(std::function<void()> task) {
+        pending.fetch_add(1);
+        pool.submit([this, task = std::move(task)] {
+            try {
+                task();
+            } catch (const SortCancelled &) {
+                cancelled.store(true, std::memory_order_relaxed);
+            }
+            pending.fetch_sub(1, std::memory_order_release);
+        });
+    }
+
+    void wait() {
+        finish();
+        if (cancelled.load(std::memory_order_relaxed))
+            throw SortCancelled();
+    }
+
+private:
+    void finish() {
+        while (pending.load(std::memory_order_acquire) > 0) {
+            if (!pool.runPendingTask())
+                std::this_thread::yield();
+        }
+    }
+
+    ThreadPool &pool;
+    std::atomic<int> pending{0};
+    std::atomic<bool> cancelled{false};
+};
+
+// Lock-free ring buffer for exactly one producer thread and one consumer thread
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+        buffer.resize(size);
+        mask = size - 1;
+    }
+
+    bool push(const T &item) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - head.load(std::memory_order_acquire) == buffer.size())
+            return false;
+        buffer[position & mask] = item;
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Pops up to max items into out, returns how many were popped
+    size_t pop(T *out, size_t max) {
+        size_t position = head.load(std::memory_order_relaxed);
+        size_t count = std::min(max, tail.load(std::memory_order_acquire) - position);
+        for (size_t i = 0; i < count; ++i)
+            out[i] = buffer[(position + i) & mask];
+        head.store(position + count, std::memory_order_release);
+        return count;
+    }
+
+    // Only safe while neither side is using the queue
+    void clear() {
+        head.store(0);
+        tail.store(0);
+    }
+
+private:
+    std::vector<T> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+// Streams the steps of a parallel sort to one trace while the sort runs. Every pool slot
+// records into a bounded queue of its own, and a merger thread takes the steps back out in
+// clock order with a k-way merge: a min-heap holds the tick at the head of each queue. The
+// clock hands out consecutive ticks (one per step or batch), so tick t is only emitted once
+// it is at the top of the heap; until then it is still on its way into a queue. A full queue
+// makes its sorting thread wait, so memory stays bounded by the queues. When the target's
+// sink throws SortCancelled, the merger stops and every sorting thread throws it at its next
+// step or task.
+class ParallelStepStream : public StepSink {
+public:
+    ParallelStepStream(StepTrace &target, ThreadPool &pool) : target(target), pool(pool) {
+        for (size_t i = 0; i < pool.slots(); ++i)
+            queues.push_back(std::make_unique<SpscQueue<TickedStep>>(QUEUE_STEPS));
+        merger = std::thread([this] { merge(); });
+    }
+    ~ParallelStepStream() { finish(); }
+
+    // Sorting threads only
+    void push(const Step &step, std::uint64_t tick) override {
+        SpscQueue<TickedStep> &queue = *queues[pool.currentSlot()];
+        while (!queue.push({step, tick})) {
+            checkCancelled();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        checkCancelled();
+    }
+
+    void checkCancelled() const {
+        if (cancelled.load(std::memory_order_relaxed))
+            throw SortCancelled();
+    }
+
+    // Waits until every queued step has reached the target (or the stream was cancelled).
+    // Returns false when it was cancelled.
+    bool finish() {
+        if (merger.joinable()) {
+            finished.store(true, std::memory_order_release);
+            merger.join();
+        }
+        return !cancelled.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct TickedStep {
+        Step step;
+        std::uint64_t tick;
+    };
+    struct Head {
+        std::uint64_t tick;
+        size_t slot;
+        bool operator>(const Head &other) const { return tick > other.tick; }
+    };
+    static constexpr size_t QUEUE_STEPS = 4096;
+    static constexpr size_t STAGED_STEPS = 256;
+
+    void merge() {
+        size_t slots = queues.size();
+        // Steps popped from each queue but not emitted yet, read from staged[slot][next[slot]] on
+        std::vector<std::vector<TickedStep>> staged(slots, std::vector<TickedStep>(STAGED_STEPS));
+        std::vector<size_t> stagedCount(slots, 0), next(slots, 0);
+        std::vector<bool> queued(slots, false); // whether the slot has an entry in the heap
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+        auto refill = [&](size_t slot) {
+            if (next[slot] == stagedCount[slot]) {
+                stagedCount[slot] = queues[slot]->pop(staged[slot].data(), STAGED_STEPS);
+                next[slot] = 0;
+            }
+            if (!queued[slot] && next[slot] < stagedCount[slot]) {
+                heads.push({staged[slot][next[slot]].tick, slot});
+                queued[slot] = true;
+            }
+        };
+        // Waits for the next staged step of slot, which is known to be on its way
+        auto take = [&](size_t slot) -> const Step & {
+            while (next[slot] == stagedCount[slot]) {
+                stagedCount[slot] = queues[slot]->pop(staged[slot].data(), STAGED_STEPS);
+                next[slot] = 0;
+                if (stagedCount[slot] == 0) {
+                    checkCancelled();
+                    std::this_thread::yield();
+                }
+            }
+            return staged[slot][next[slot]++].step;
+        };
+
+        try {
+            std::uint64_t tick = 0;
+            int idle = 0;
+            while (true) {
+                if (!heads.empty() && heads.top().tick == tick) {
+                    size_t slot = heads.top().slot;
+                    heads.pop();
+                    queued[slot] = false;
+                    // A batch shares one tick from its opening marker to its closing one
+                    Step step = take(slot);
+                    target.append(step);
+                    if (step.type == STEP_BATCH && step.b == 0) {
+                        do {
+                            step = take(slot);
+                            target.append(step);
+                        } while (step.type != STEP_BATCH || step.b != 1);
+                    }
+                    refill(slot);
+                    tick++;
+                    idle = 0;
+                    continue;
+                }
+                // The next tick is in a queue that ran dry earlier, or still in flight
+                bool done = finished.load(std::memory_order_acquire);
+                for (size_t slot = 0; slot < slots; ++slot)
+                    refill(slot);
+                if (!heads.empty() && heads.top().tick == tick)
+                    continue;
+                if (done && heads.empty())
+                    return;
+                if (++idle < 64)
+                    std::this_thread::yield();
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        } catch (const SortCancelled &) {
+            cancelled.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    StepTrace &target;
+    ThreadPool &pool;
+    std::vector<std::unique_ptr<SpscQueue<TickedStep>>> queues;
+    std::thread merger;
+    std::atomic<bool> finished{false};
+    std::atomic<bool> cancelled{false};
+};
+
+// Shared state of one parallel sort. Each thread records into its own trace.
+struct ParallelSort {
+    ThreadPool &pool;
+    std::vector<StepTrace> &traces;
+    std::vector<int> &scratch; // merge buffer as large as the array, shared by every thread
+    int cutoff; // ranges up to this size are sorted by a single thread
+    int networkBlock; // base case size of the sequential sorts, 0 = no sorting networks
+    ParallelStepStream *stream; // where the traces send their steps, null when they only count
+
+    StepTrace &trace() { return traces[pool.currentSlot()]; }
+
+    // Lets a task that has not recorded anything yet notice that the sort was cancelled
+    void checkCancelled() const {
+        if (stream)
+            stream->checkCancelled();
+    }
+};
+
+// Merges scratch[a0, a1) and scratch[b0, b1) into array from k on. Large merges are split
+// around the median of the longer run, and the two halves are merged in parallel.
+void parallelMerge(std::vector<int> &array, int a0, int a1, int b0, int b1, int k, ParallelSort &context) {
+    context.checkCancelled();
+    const std::vector<int> &scratch = context.scratch;
+    StepTrace &trace = context.trace();
+    if ((a1 - a0) + (b1 - b0) <= context.cutoff) {
+        while (a0 < a1 && b0 < b1) {
+            trace.compare(a0, b0);
+            array[k] = scratch[a0] <= scratch[b0] ? scratch[a0++] : scratch[b0++];
+            trace.write(k, array[k]);
+            k++;
+        }
+        while (a0 < a1) {
+            array[k] = scratch[a0++];
+            trace.write(k, array[k]);
+            k++;
+        }
+        while (b0 < b1) {
+            array[k] = scratch[b0++];
+            trace.write(k, array[k]);
+            k++;
+        }
+        return;
+    }
+
+    // Equal keys from the first run always end up before those of the second one
+    int aSplit, bSplit;
+    if (a1 - a0 >= b1 - b0) {
+        aSplit = a0 + (a1 - a0) / 2;
+        bSplit = std::lower_bound(scratch.begin() + b0, scratch.begin() + b1, scratch[aSplit]) - scratch.begin();
+    } else {
+        bSplit = b0 + (b1 - b0) / 2;
+        aSplit = std::upper_bound(scratch.begin() + a0, scratch.begin() + a1, scratch[bSplit]) - scratch.begin();
+    }
+    trace.compare(aSplit, std::min(bSplit, b1 - 1));
+
+    TaskGroup group(context.pool);
+    group.run([&] { parallelMerge(array, a0, aSplit, b0, bSplit, k, context); });
+    parallelMerge(array, aSplit, a1, bSplit, b1, k + (aSplit - a0) + (bSplit - b0), context);
+    group.wait();
+}
+
+void parallelMergeSort(std::vector<int> &array, int left, int right, ParallelSort &context) {
+    context.checkCancelled();
+    if (right - left + 1 <= context.cutoff) {
+        mergeSort(array.begin(), context.scratch.begin(), left, right, context.trace(), context.networkBlock);
+        return;
+    }
+
+    int mid = left + (right - left) / 2;
+    TaskGroup group(context.pool);
+    group.run([&] { parallelMergeSort(array, left, mid, context); });
+    parallelMergeSort(array, mid + 1, right, context);
+    group.wait();
+
+    std::copy(array.begin() + left, array.begin() + right + 1, context.scratch.begin() + left);
+    context.trace().range(left, right);
+    parallelMerge(array, left, mid + 1, mid + 1, right + 1, left, context);
+}
+
+// Hoare partition around the median of array[low], array[mid] and array[high].
+// Both scans stop on keys equal to the pivot, so sorted input and runs of equal keys
+// still split near the middle. Returns j such that [low, j] <= pivot <= [j + 1, high].
+int partitionHoare(std::vector<int> &array, int low, int high, StepTrace &trace) {
+    int mid = low + (high - low) / 2;
+    trace.range(low, high);
+    trace.compare(low, mid);
+    if (array[mid] < array[low]) {
+        std::swap(array[mid], array[low]);
+        trace.swap(mid, low);
+    }
+    trace.compare(mid, high);
+    if (array[high] < array[mid]) {
+        std::swap(array[high], array[mid]);
+        trace.swap(high, mid);
+        trace.compare(low, mid);
+        if (array[mid] < array[low]) {
+            std::swap(array[mid], array[low]);
+            trace.swap(mid, low);
+        }
+    }
+
+    // The pivot's key is compared by value, but the trace follows the slot holding it, which
+    // a swap can move
+    int pivot = array[mid];
+    int pivotAt = mid;
+    trace.pivot(pivotAt);
+    int i = low - 1;
+    int j = high + 1;
+    while (true) {
+        do {
+            i++;
+            trace.compare(i, pivotAt);
+        } while (array[i] < pivot);
+        do {
+            j--;
+            trace.compare(j, pivotAt);
+        } while (array[j] > pivot);
+        if (i >= j)
+            return j;
+        std::swap(array[i], array[j]);
+        trace.swap(i, j);
+        if (pivotAt == i || pivotAt == j) {
+            pivotAt = pivotAt == i ? j : i;
+            trace.pivot(pivotAt);
+        }
+    }
+}
+
+// Large ranges hand their larger side to the pool and loop on the smaller one, small ranges
+// recurse into the smaller side and loop on the larger one, so no thread's stack grows more
+// than O(log n) deep. Once depthLimit partitions have not made the range small, it is heap
+// sorted, as in intro sort.
+void parallelQuickSort(std::vector<int> &array, int low, int high, int depthLimit, ParallelSort &context) {
+    TaskGroup group(context.pool);
+    while (true) {
+        context.checkCancelled();
+        if (low >= high || networkSort(array.begin(), low, high, context.networkBlock, context.trace()))
+            break;
+        if (depthLimit == 0) {
+            heapSortRange(array.begin(), low, high, context.trace());
+            break;
+        }
+        depthLimit--;
+
+        int split = partitionHoare(array, low, high, context.trace());
+        bool leftSmaller = split - low < high - split;
+        if (high - low + 1 <= context.cutoff) {
+            if (leftSmaller) {
+                parallelQuickSort(array, low, split, depthLimit, context);
+                low = split + 1;
+            } else {
+                parallelQuickSort(array, split + 1, high, depthLimit, context);
+                high = split;
+            }
+        } else if (leftSmaller) {
+            group.run([&array, &context, split, high, depthLimit] { parallelQuickSort(array, split + 1, high, depthLimit, context); });
+            high = split;
+        } else {
+            group.run([&array, &context, low, split, depthLimit] { parallelQuickSort(array, low, split, depthLimit, context); });
+            low = split + 1;
+        }
+    }
+    group.wait();
+}
+
+// Runs one of the parallel algorithms on a pool of threads (0 = one per core). The steps
+// of every thread are streamed into trace in the order they happened, and the per-thread
+// counts are added to it at the end.
+void runParallel(SortAlgorithm algorithm, std::vector<int> &array, StepTrace &trace, unsigned threads, int networkBlock) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    ThreadPool pool(threads - 1);
+
+    std::atomic<std::uint64_t> clock(0);
+    std::unique_ptr<ParallelStepStream> stream;
+    if (trace.isKeepingSteps())
+        stream = std::make_unique<ParallelStepStream>(trace, pool);
+    std::vector<StepTrace> traces;
+    for (size_t i = 0; i < pool.slots(); ++i) {
+        traces.emplace_back(trace.isKeepingSteps());
+        traces.back().setClock(&clock);
+        traces.back().setSink(stream.get());
+    }
+
+    std::vector<int> scratch;
+    if (algorithm == PARALLEL_MERGE_SORT) {
+        scratch.resize(array.size());
+        traces.back().allocate(scratch.size() * sizeof(int));
+    }
+
+    int cutoff = std::max<int>(8, std::min<int>(1 << 14, array.size() / (threads * 8)));
+    ParallelSort context{pool, traces, scratch, cutoff, networkBlock, stream.get()};
+    if (algorithm == PARALLEL_MERGE_SORT) {
+        parallelMergeSort(array, 0, array.size() - 1, context);
+    } else {
+        int depthLimit = 2 * (int)std::log2(std::max<size_t>(array.size(), 1));
+        parallelQuickSort(array, 0, array.size() - 1, depthLimit, context);
+    }
+    if (stream && !stream->finish())
+        throw SortCancelled();
+    trace.absorbCounts(traces);
+}
+
+struct SortOptions {
+    unsigned threads = 0; // threads used by the parallel algorithms, 0 = one per core
+    int networkBlock = 0; // largest range the recursive sorts hand to a sorting network (8 to 64), 0 = none
+    int heapArity = 2; // children per node in heap sort: 2, 4 or 8
+    bool bottomUpHeap = false; // Floyd's bottom-up sift in the sort phase of heap sort
+};
+
+// Runs the selected algorithm to completion, recording every step into trace.
+void runAlgorithm(SortAlgorithm algorithm, std::vector<int> &array, StepTrace &trace, const SortOptions &options = SortOptions()) {
+    if (array.empty())
+        return;
+    if (algorithm == BUBBLE_SORT) {
+        bubbleSort(array.begin(), array.size(), trace);
+    } else if (algorithm == HEAP_SORT) {
+        heapSort(array.begin(), array.size(), trace, options.heapArity, options.bottomUpHeap);
+    } else if (algorithm == QUICK_SORT) {
+        quickSort(array.begin(), 0, array.size() - 1, trace, options.networkBlock);
+    } else if (algorithm == MERGE_SORT) {
+        mergeSort(array.begin(), 0, array.size() - 1, trace, options.networkBlock);
+    } else if (algorithm == SELECTION_SORT) {
+        selectionSort(array.begin(), array.size(), trace);
+    } else if (algorithm == BOTTOM_UP_MERGE_SORT) {
+        bottomUpMergeSort(array.begin(), array.size(), trace);
+    } else if (algorithm == INTRO_SORT) {
+        introSort(array.begin(), array.size(), trace, options.networkBlock);
+    } else if (algorithm == TIM_SORT) {
+        timSort(array.begin(), array.size(), trace);
+    } else if (algorithm == RADIX_SORT_LSD_8) {
+        radixSortLSD(array, 8, trace);
+    } else if (algorithm == RADIX_SORT_LSD_11) {
+        radixSortLSD(array, 11, trace);
+    } else if (algorithm == RADIX_SORT_LSD_16) {
+        radixSortLSD(array, 16, trace);
+    } else if (algorithm == RADIX_SORT_MSD) {
+        americanFlagSort(array, 0, array.size() - 1, 24, trace, options.networkBlock);
+    } else if (algorithm == COUNTING_SORT) {
+        countingSort(array, trace);
+    } else if (algorithm == PARALLEL_MERGE_SORT || algorithm == PARALLEL_QUICK_SORT) {
+        runParallel(algorithm, array, trace, options.threads, options.networkBlock);
+    }
+}
+
+// Whether sortRange handles the algorithm for keys other than int
+bool isGeneric(SortAlgorithm algorithm) {
+    return algorithm == BUBBLE_SORT || algorithm == HEAP_SORT || algorithm == QUICK_SORT || algorithm == MERGE_SORT
+        || algorithm == SELECTION_SORT || algorithm == BOTTOM_UP_MERGE_SORT || algorithm == INTRO_SORT || algorithm == TIM_SORT;
+}
+
+// Sorts [first, last) by comp over proj(element) with nothing recorded, for any key type. The
+// radix, counting and parallel sorts are int-only and return false
+template <typename RandomIt, typename Compare = std::less<>, typename Projection = Identity>
+bool sortRange(SortAlgorithm algorithm, RandomIt first, RandomIt last, Compare comp = Compare(), Projection proj = Projection(),
+               const SortOptions &options = SortOptions()) {
+    ProjectedLess<Compare, Projection> less{comp, proj};
+    NullRecorder recorder;
+    int n = last - first;
+    if (!isGeneric(algorithm))
+        return false;
+    if (n < 2)
+        return true;
+    if (algorithm == BUBBLE_SORT) {
+        bubbleSort(first, n, recorder, less);
+    } else if (algorithm == HEAP_SORT) {
+        heapSort(first, n, recorder, options.heapArity, options.bottomUpHeap, less);
+    } else if (algorithm == QUICK_SORT) {
+        quickSort(first, 0, n - 1, recorder, options.networkBlock, less);
+    } else if (algorithm == MERGE_SORT) {
+        mergeSort(first, 0, n - 1, recorder, options.networkBlock, less);
+    } else if (algorithm == SELECTION_SORT) {
+        selectionSort(first, n, recorder, less);
+    } else if (algorithm == BOTTOM_UP_MERGE_SORT) {
+        bottomUpMergeSort(first, n, recorder, less);
+    } else if (algorithm == INTRO_SORT) {
+        introSort(first, n, recorder, options.networkBlock, less);
+    } else if (algorithm == TIM_SORT) {
+        timSort(first, n, recorder, less);
+    }
+    return true;
+}
+
+
+// Whether the algorithm recurses down to small ranges that SortOptions::networkBlock applies to
+bool usesNetworks(SortAlgorithm algorithm) {
+    return algorithm == QUICK_SORT || algorithm == MERGE_SORT || algorithm == INTRO_SORT || algorithm == PARALLEL_MERGE_SORT
+        || algorithm == PARALLEL_QUICK_SORT || algorithm == RADIX_SORT_MSD;
+}
+
+// Cache miss and branch miss counters of the calling thread and the threads it starts,
+// read through perf_event_open on Linux. A counter that cannot be opened (other systems,
+// or perf_event_paranoid) reads -1.
+class PerfCounters {
+public:
+    PerfCounters() {
+#ifdef __linux__
+        l1Fd = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        cacheFd = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        branchFd = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+    }
+    ~PerfCounters() {
+#ifdef __linux__
+        if (l1Fd >= 0)
+            close(l1Fd);
+        if (cacheFd >= 0)
+            close(cacheFd);
+        if (branchFd >= 0)
+            close(branchFd);
+#endif
+    }
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Without reset the counts carry on from where stop() left them
+    void start(bool reset = true) {
+#ifdef __linux__
+        for (int fd : {l1Fd, cacheFd, branchFd}) {
+            if (fd >= 0) {
+                if (reset)
+                    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+    void stop() {
+#ifdef __linux__
+        for (int fd : {l1Fd, cacheFd, branchFd})
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    }
+
+    std::int64_t getL1Misses() const { return readCounter(l1Fd); }
+    std::int64_t getCacheMisses() const { return readCounter(cacheFd); }
+    std::int64_t getBranchMisses() const { return readCounter(branchFd); }
+
+private:
+#ifdef __linux__
+    // User space only, and inherited by threads started after it was opened
+    static int openCounter(std::uint32_t type, std::uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    static std::int64_t readCounter(int fd) {
+#ifdef __linux__
+        std::uint64_t value;
+        if (fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value))
+            return (std::int64_t)value;
+#endif
+        return -1;
+    }
+
+    int l1Fd = -1;
+    int cacheFd = -1;
+    int branchFd = -1;
+};
+
+// Steps the window takes from a running sort ahead of the playback position. The rest wait
+// in the worker's queue, so the sort only runs as far ahead of what is on screen as this.
+const size_t PLAYBACK_LOOKAHEAD = 1 << 20;
+
+// Runs a sort on its own thread and streams the steps it records to the render thread,
+// which can keep handling events while the sort runs. When the queue is full the sort
+// waits for the render thread to catch up.
+class SortWorker : public StepSink {
+public:
+    SortWorker() : queue(1 << 16), incoming(1 << 16) {}
+    ~SortWorker() { cancel(); }
+
+    void start(SortAlgorithm algorithm, const std::vector<int> &input, const SortOptions &options) {
+        cancel();
+        cancelled = false;
+        paused = false;
+        done = false;
+        stepsPushed = 0;
+        pushed = 0;
+        sortNanoseconds = 0;
+        l1Misses = cacheMisses = branchMisses = -1;
+        thread = std::thread([this, algorithm, input, options] {
+            std::vector<int> array = input;
+            StepTrace trace;
+            trace.setSink(this);
+            // Opened on this thread so that it counts the sort and any pool it starts
+            PerfCounters perfCounters;
+            counters = &perfCounters;
+            runStart = std::chrono::steady_clock::now();
+            waited = std::chrono::steady_clock::duration::zero();
+            perfCounters.start();
+            try {
+                runAlgorithm(algorithm, array, trace, options);
+            } catch (const SortCancelled &) {
+            }
+            perfCounters.stop();
+            publish();
+            counters = nullptr;
+            done.store(true, std::memory_order_release);
+        });
+    }
+
+    // Stops the sort (if any) and waits for its thread to exit
+    void cancel() {
+        if (thread.joinable()) {
+            cancelled = true;
+            thread.join();
+        }
+        queue.clear();
+    }
+
+    void togglePause() { paused = !paused; }
+    bool isPaused() const { return paused; }
+    bool isRunning() const { return thread.joinable() && !done.load(std::memory_order_acquire); }
+
+    // Moves up to max queued steps to the end of the player's trace
+    void drain(TracePlayer &player, size_t max) {
+        while (max > 0) {
+            size_t count = queue.pop(incoming.data(), std::min(max, incoming.size()));
+            if (count == 0)
+                break;
+            for (size_t i = 0; i < count; ++i)
+                player.append(incoming[i]);
+            max -= count;
+        }
+    }
+
+    // Called on the worker thread for every recorded step (for a parallel sort, on the thread
+    // merging its per-thread streams). Time and counters spent waiting for the render thread
+    // are left out of the sort's totals.
+    void push(const Step &step, std::uint64_t) override {
+        if (paused.load(std::memory_order_relaxed) || !queue.push(step)) {
+            counters->stop();
+            auto waitStart = std::chrono::steady_clock::now();
+            while (paused.load(std::memory_order_relaxed) || !queue.push(step)) {
+                if (cancelled.load(std::memory_order_relaxed))
+                    throw SortCancelled();
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            waited += std::chrono::steady_clock::now() - waitStart;
+            counters->start(false);
+        }
+        if (cancelled.load(std::memory_order_relaxed))
+            throw SortCancelled();
+        if ((++pushed & 4095) == 0)
+            publish();
+    }
+
+    // Totals of the current (or last) sort, updated every few thousand steps
+    std::uint64_t getSteps() const { return stepsPushed.load(std::memory_order_relaxed); }
+    double getNanosecondsPerStep() const {
+        std::uint64_t steps = getSteps();
+        return steps > 0 ? (double)sortNanoseconds.load(std::memory_order_relaxed) / steps : 0.0;
+    }
+    std::int64_t getL1Misses() const { return l1Misses.load(std::memory_order_relaxed); }
+    std::int64_t getCacheMisses() const { return cacheMisses.load(std::memory_order_relaxed); }
+    std::int64_t getBranchMisses() const { return branchMisses.load(std::memory_order_relaxed); }
+
+private:
+    SpscQueue<Step> queue;
+    std::vector<Step> incoming;
+    std::thread thread;
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> paused{false};
+    std::atomic<bool> done{false};
+
+    // Only called by the thread pushing the steps
+    void publish() {
+        stepsPushed.store(pushed, std::memory_order_relaxed);
+        auto active = std::chrono::steady_clock::now() - runStart - waited;
+        sortNanoseconds.store(std::chrono::duration_cast<std::chrono::nanoseconds>(active).count(), std::memory_order_relaxed);
+        l1Misses.store(counters->getL1Misses(), std::memory_order_relaxed);
+        cacheMisses.store(counters->getCacheMisses(), std::memory_order_relaxed);
+        branchMisses.store(counters->getBranchMisses(), std::memory_order_relaxed);
+    }
+    PerfCounters *counters = nullptr;
+    std::chrono::steady_clock::time_point runStart;
+    std::chrono::steady_clock::duration waited{};
+    std::uint64_t pushed = 0;
+
+    std::atomic<std::uint64_t> stepsPushed{0};
+    std::atomic<std::uint64_t> sortNanoseconds{0};
+    std::atomic<std::int64_t> l1Misses{-1};
+    std::atomic<std::int64_t> cacheMisses{-1};
+    std::atomic<std::int64_t> branchMisses{-1};
+};
+
+// Draws the player's current state with the view that matches the algorithm. The caller
+// displays the frame, so overlays can be drawn on top.
+void renderPlayer(sf::RenderTarget &target, BarRenderer &bars, LabelLayer &labels, HeapRenderer &heap, HighlightBuffer &highlights, TracePlayer &player, SortAlgorithm algorithm, const SortOptions &sort, const sf::Text &text) {
+    const std::vector<int> &array = player.getArray();
+    const Step *step = player.lastStep();
+    const Step *batch = nullptr;
+    size_t batchSize = player.lastBatch(batch);
+    if (highlights.size() != array.size())
+        highlights.resize(array.size());
+
+    if (algorithm == HEAP_SORT) {
+        int heapSize = player.getRangeHigh() >= 0 ? player.getRangeHigh() + 1 : array.size();
+        visualizeHeap(target, heap, labels, array, player.getTouched(), player.isAllTouched(), text, heapSize, sort.heapArity);
+        player.clearTouched();
+        return;
+    }
+
+    // Network stages of the merge sorts are drawn by the generic view below
+    if ((algorithm == MERGE_SORT || algorithm == PARALLEL_MERGE_SORT || algorithm == BOTTOM_UP_MERGE_SORT) && batchSize == 0) {
+        int leftIndex = -1, rightIndex = -1, pivotIndex = -1;
+        if (step && step->type == STEP_COMPARE) {
+            leftIndex = step->a;
+            rightIndex = step->b;
+        } else if (step && step->type == STEP_WRITE) {
+            pivotIndex = step->a;
+        }
+        visualizeBarsAndArrayMerge(target, bars, labels, highlights, array, player.getTouched(), player.isAllTouched(), text, pivotIndex, leftIndex, rightIndex);
+        player.clearTouched();
+        return;
+    }
+
+    // Bars are white unless highlighted, so only the highlighted indices are set
+    highlights.clear();
+    if (player.getRangeLow() >= 0 && player.getRangeHigh() >= 0) {
+        highlights.set(player.getRangeLow(), sf::Color::Red);
+        highlights.set(player.getRangeHigh(), sf::Color::Red);
+    }
+    if (player.getPivot() >= 0) {
+        highlights.set(player.getPivot(), sf::Color::Red);
+    }
+    if (step && step->type == STEP_COMPARE) {
+        highlights.set(step->a, sf::Color::Green);
+        highlights.set(step->b, sf::Color::Green);
+    } else if (step && step->type == STEP_SWAP) {
+        highlights.set(step->a, sf::Color::Red);
+        highlights.set(step->b, sf::Color::Red);
+    } else if (step && step->type == STEP_WRITE) {
+        highlights.set(step->a, sf::Color::Red);
+    }
+    // A network stage lights up all of its comparators at once
+    for (size_t i = 0; i < batchSize; ++i) {
+        sf::Color color = batch[i].type == STEP_SWAP ? sf::Color::Red : sf::Color::Green;
+        highlights.set(batch[i].a, color);
+        highlights.set(batch[i].b, color);
+    }
+    visualizeBarsAndArray(target, bars, labels, array, player.getTouched(), player.isAllTouched(), text, highlights);
+    if (algorithm == TIM_SORT)
+        bars.drawRuns(target, player.getRuns());
+    player.clearTouched();
+}
+
+// Render thread costs averaged over about a second, together with what the worker measured
+// for the sort. Shown as an overlay (I in the window) and appended to a file with O.
+class Instrumentation {
+public:
+    Instrumentation() : windowStart(std::chrono::steady_clock::now()) {}
+
+    void beginFrame() {
+        frameStart = std::chrono::steady_clock::now();
+        drawCallsAtStart = drawCallCount;
+        allocationsAtStart = allocationCount.load(std::memory_order_relaxed);
+    }
+
+    // Returns true when the averages were refreshed
+    bool endFrame() {
+        auto now = std::chrono::steady_clock::now();
+        renderTime += now - frameStart;
+        drawCalls += drawCallCount - drawCallsAtStart;
+        allocations += allocationCount.load(std::memory_order_relaxed) - allocationsAtStart;
+        frames++;
+
+        double elapsed = std::chrono::duration<double>(now - windowStart).count();
+        if (elapsed < 1.0)
+            return false;
+        renderMilliseconds = std::chrono::duration<double, std::milli>(renderTime).count() / frames;
+        drawCallsPerFrame = (double)drawCalls / frames;
+        allocationsPerFrame = (double)allocations / frames;
+        framesPerSecond = frames / elapsed;
+        windowStart = now;
+        renderTime = std::chrono::steady_clock::duration::zero();
+        drawCalls = allocations = frames = 0;
+        return true;
+    }
+
+    std::string report(const SortWorker &worker) const {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(2) << "render " << renderMilliseconds << " ms/frame ("
+            << std::setprecision(0) << framesPerSecond << " fps)\n"
+            << std::setprecision(1) << "draw calls " << drawCallsPerFrame << "/frame\n"
+            << "allocations " << allocationsPerFrame << "/frame\n"
+            << "sort " << worker.getNanosecondsPerStep() << " ns/step, " << worker.getSteps() << " steps\n";
+        const char *names[] = {"L1d misses ", "cache misses ", "branch misses "};
+        std::int64_t counts[] = {worker.getL1Misses(), worker.getCacheMisses(), worker.getBranchMisses()};
+        for (int i = 0; i < 3; ++i) {
+            out << names[i];
+            if (counts[i] >= 0)
+                out << counts[i];
+            else
+                out << "-";
+            out << "\n";
+        }
+        return out.str();
+    }
+
+    // Appends the report to path, headed by the time and the title
+    bool dump(const std::string &path, const std::string &title, const SortWorker &worker) const {
+        std::ofstream file(path, std::ios::app);
+        if (!file) {
+            std::cerr << "Cannot open " << path << " for writing\n";
+            return false;
+        }
+        std::time_t now = std::time(nullptr);
+        file << "# " << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M:%S") << "\n" << title << "\n" << report(worker) << "\n";
+        return true;
+    }
+
+private:
+    std::chrono::steady_clock::time_point windowStart;
+    std::chrono::steady_clock::time_point frameStart;
+    std::chrono::steady_clock::duration renderTime{};
+    std::uint64_t drawCallsAtStart = 0, allocationsAtStart = 0;
+    std::uint64_t drawCalls = 0, allocations = 0, frames = 0;
+
+    double renderMilliseconds = 0.0;
+    double drawCallsPerFrame = 0.0;
+    double allocationsPerFrame = 0.0;
+    double framesPerSecond = 0.0;
+};
+
+
+sf::Color generateRandomColor() {
+    int r = rand() % 256;
+    int g = rand() % 256;
+    int b = rand() % 256;
+    return sf::Color(r, g, b);
+}
+
+// Input generators
+enum Distribution {DIST_RANDOM, DIST_SORTED, DIST_REVERSED, DIST_FEW_UNIQUE, DIST_NEARLY_SORTED, DIST_GAUSSIAN, DIST_SORTED_RUNS, DIST_SAWTOOTH, DIST_DUPLICATES};
+
+const size_t MIN_ARRAY_SIZE = 10;
+const size_t MAX_ARRAY_SIZE = 10000000;
+// The sorts index with int and compute child and run offsets such as 8 * i + 8, so benchmark
+// sizes stop well below INT_MAX
+const size_t MAX_BENCHMARK_SIZE = 1 << 28;
+
+struct AlgorithmInfo {
+    SortAlgorithm algorithm;
+    const char *name;
+    const char *option; // name used on the command line
+};
+
+const AlgorithmInfo ALGORITHMS[] = {
+    {BUBBLE_SORT, "Bubble Sort", "bubble"},
+    {HEAP_SORT, "Heap Sort", "heap"},
+    {QUICK_SORT, "Quick Sort", "quick"},
+    {MERGE_SORT, "Merge Sort", "merge"},
+    {SELECTION_SORT, "Selection Sort", "selection"},
+    {PARALLEL_MERGE_SORT, "Parallel Merge Sort", "parallel-merge"},
+    {PARALLEL_QUICK_SORT, "Parallel Quick Sort", "parallel-quick"},
+    {BOTTOM_UP_MERGE_SORT, "Bottom-Up Merge Sort", "bottom-up-merge"},
+    {INTRO_SORT, "Intro Sort", "intro"},
+    {RADIX_SORT_LSD_8, "LSD Radix Sort (8-bit)", "radix-lsd8"},
+    {RADIX_SORT_LSD_11, "LSD Radix Sort (11-bit)", "radix-lsd11"},
+    {RADIX_SORT_LSD_16, "LSD Radix Sort (16-bit)", "radix-lsd16"},
+    {RADIX_SORT_MSD, "MSD Radix Sort", "radix-msd"},
+    {COUNTING_SORT, "Counting Sort", "counting"},
+    {TIM_SORT, "Tim Sort", "tim"},
+};
+
+struct DistributionInfo {
+    Distribution distribution;
+    const char *option;
+};
+
+const DistributionInfo DISTRIBUTIONS[] = {
+    {DIST_RANDOM, "random"},
+    {DIST_SORTED, "sorted"},
+    {DIST_REVERSED, "reversed"},
+    {DIST_FEW_UNIQUE, "few-unique"},
+    {DIST_NEARLY_SORTED, "nearly-sorted"},
+    {DIST_GAUSSIAN, "gaussian"},
+    {DIST_SORTED_RUNS, "sorted-runs"},
+    {DIST_SAWTOOTH, "sawtooth"},
+    {DIST_DUPLICATES, "duplicates"},
+};
+
+// The array is generated in blocks of GENERATOR_BLOCK values, each with its own engine
+// seeded from (seed, block). The output only depends on the seed, whatever the number of
+// threads filling the blocks.
+const size_t GENERATOR_BLOCK = 1 << 16;
+
+// SplitMix64 finaliser, spreads consecutive block numbers over unrelated seeds
+std::uint64_t mixSeed(std::uint64_t seed, std::uint64_t block) {
+    std::uint64_t z = seed + (block + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void generateBlock(std::vector<int> &array, size_t begin, size_t end, Distribution distribution, int maxValue, std::uint64_t seed) {
+    std::mt19937_64 rng(mixSeed(seed, begin / GENERATOR_BLOCK));
+    std::uniform_int_distribution<int> values(0, maxValue);
+    size_t size = array.size();
+    // Evenly spaced values from 0 to maxValue, the base of the sorted shapes
+    auto ramp = [&](size_t i) { return (int)((std::uint64_t)i * maxValue / std::max<size_t>(1, size - 1)); };
+
+    switch (distribution) {
+        case DIST_RANDOM:
+            for (size_t i = begin; i < end; ++i)
+                array[i] = values(rng);
+            break;
+        case DIST_SORTED:
+            for (size_t i = begin; i < end; ++i)
+                array[i] = ramp(i);
+            break;
+        case DIST_REVERSED:
+            for (size_t i = begin; i < end; ++i)
+                array[i] = ramp(size - 1 - i);
+            break;
+        case DIST_FEW_UNIQUE: {
+            std::uniform_int_distribution<int> few(0, 7);
+            for (size_t i = begin; i < end; ++i)
+                array[i] = few(rng) * (maxValue / 7);
+            break;
+        }
+        case DIST_NEARLY_SORTED: {
+            // Sorted, then about 1% of the elements swapped with a close neighbour
+            for (size_t i = begin; i < end; ++i)
+                array[i] = ramp(i);
+            std::uniform_int_distribution<size_t> index(begin, end - 1);
+            for (size_t swaps = (end - begin) / 100 + 1; swaps > 0; --swaps) {
+                size_t i = index(rng);
+                size_t j = std::min(end - 1, i + 1 + index(rng) % 8);
+                std::swap(array[i], array[j]);
+            }
+            break;
+        }
+        case DIST_GAUSSIAN: {
+            std::normal_distribution<double> normal(maxValue / 2.0, maxValue / 6.0);
+            for (size_t i = begin; i < end; ++i)
+                array[i] = (int)std::clamp(normal(rng), 0.0, (double)maxValue);
+            break;
+        }
+        case DIST_SORTED_RUNS: {
+            // Ascending runs of 16 to 4096 random values
+            std::uniform_int_distribution<size_t> runLength(16, 4096);
+            for (size_t i = begin; i < end; ++i)
+                array[i] = values(rng);
+            for (size_t run = begin; run < end;) {
+                size_t runEnd = std::min(end, run + runLength(rng));
+                std::sort(array.begin() + run, array.begin() + runEnd);
+                run = runEnd;
+            }
+            break;
+        }
+        case DIST_SAWTOOTH: {
+            size_t period = std::max<size_t>(2, size / 4);
+            for (size_t i = begin; i < end; ++i)
+                array[i] = (int)((std::uint64_t)(i % period) * maxValue / (period - 1));
+            break;
+        }
+        case DIST_DUPLICATES: {
+            // Roughly one distinct value per 16 elements
+            int distinct = std::max<int>(4, std::min<size_t>(maxValue, size / 16));
+            std::uniform_int_distribution<int> key(0, distinct - 1);
+            for (size_t i = begin; i < end; ++i)
+                array[i] = (int)((std::int64_t)key(rng) * maxValue / (distinct - 1));
+            break;
+        }
+    }
+}
+
+// Generates size values in [0, maxValue]. Large arrays are filled by several threads.
+std::vector<int> generateInput(Distribution distribution, size_t size, std::uint64_t seed, int maxValue) {
+    std::vector<int> array(size);
+    size_t blocks = (size + GENERATOR_BLOCK - 1) / GENERATOR_BLOCK;
+    unsigned threads = std::min<size_t>(blocks, std::max(1u, std::thread::hardware_concurrency()));
+
+    std::atomic<size_t> nextBlock(0);
+    auto fill = [&] {
+        for (size_t block = nextBlock++; block < blocks; block = nextBlock++) {
+            size_t begin = block * GENERATOR_BLOCK;
+            generateBlock(array, begin, std::min(size, begin + GENERATOR_BLOCK), distribution, maxValue, seed);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+        workers.emplace_back(fill);
+    fill();
+    for (std::thread &worker : workers)
+        worker.join();
+    return array;
+}
+
+// Command line and headless benchmark mode
+struct CommandLineOptions {
+    bool help = false;
+    bool benchmark = false;
+    std::vector<SortAlgorithm> algorithms;
+    std::vector<size_t> sizes;
+    std::vector<Distribution> distributions;
+    std::uint64_t seed = 42;
+    bool hasSeed = false;
+    int maxValue = 0; // 0 = 199 in the window, 10^9 in the benchmark
+    size_t size = 20;
+    Distribution distribution = DIST_RANDOM;
+    SortOptions sort;
+    std::vector<int> heapArities; // the benchmark runs heap sort once per arity
+    std::vector<std::string> keyTypes; // key types the benchmark sorts, int is the only one recorded
+    std::string format = "table";
+    std::string output;
+    std::string statsFile = "instrumentation.txt"; // where O in the window appends the overlay
+    std::string traceFile = "sort.trace"; // saved with S and loaded with L in the window
+    bool saveTrace = false; // record the trace file without opening the window
+    std::string exportPath; // empty = open the window
+    int fps = 60;
+    float exportSpeed = 0.0f; // steps per second of video, 0 = fit the sort in a minute
+    bool race = false; // every --algorithms entry sorts the same input side by side
+    std::string externalInput; // file of integers to sort on disk, empty = none
+    std::string externalOutput; // empty = the input path with .sorted appended
+    size_t memory = 512; // megabytes the external sort may use
+    SortAlgorithm externalAlgorithm = INTRO_SORT; // sorts the runs, the first of --algorithms if given
+};
+
+struct BenchmarkResult {
+    std::string algorithm;
+    const char *distribution;
+    size_t size;
+    double milliseconds;
+    std::uint64_t comparisons;
+    std::uint64_t swaps;
+    std::uint64_t writes;
+    size_t peakExtraBytes;
+    bool sorted;
+    int networkBlock; // sorting network base case, 0 = none
+    double speedup; // time without networks / time with them, 0 = not measured
+    std::int64_t l1Misses; // L1 data cache read misses, -1 = no counter
+    std::int64_t cacheMisses; // last level cache misses, -1 = no counter
+    std::int64_t branchMisses; // mispredicted branches, -1 = no counter
+    bool counted; // false for keys other than int, which are sorted with nothing recorded
+};
+
+// Key type for the "record" benchmark keys, sorted by key through a projection
+struct Record {
+    int key;
+    std::uint32_t payload;
+};
+
+const char *const KEY_TYPES[] = {"int", "u64", "float", "string", "record"};
+
+std::vector<std::string> splitList(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+// Parses all of text as a decimal number. Signs, trailing characters and values that do not
+// fit are rejected.
+bool parseUnsigned(const std::string &text, unsigned long long &value) {
+    const char *end = text.data() + text.size();
+    std::from_chars_result result = std::from_chars(text.data(), end, value);
+    return !text.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+// Same for a finite decimal number with an optional fraction or exponent
+bool parseFloat(const std::string &text, float &value) {
+    if (text.empty() || std::isspace((unsigned char)text[0]))
+        return false;
+    char *end;
+    errno = 0;
+    value = std::strtof(text.c_str(), &end);
+    return errno == 0 && end == text.c_str() + text.size() && std::isfinite(value);
+}
+
+// Upper bounds of the numeric options that have no natural limit of their own
+const unsigned long long MAX_THREADS = 1024;
+const unsigned long long MAX_FPS = 1000;
+const unsigned long long MAX_EXTERNAL_MEMORY = 1 << 20; // MB
+const float MAX_EXPORT_SPEED = 1e7f; // steps per second, as fast as the player goes
+
+void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " [--size n] [--distribution d] [--seed s] [--bench [options]]\n"
+              << "  --help                   show this message\n"
+              << "  --size n                 number of elements shown in the window, 10 to 10000000 (default: 20)\n"
+              << "  --distribution d         input distribution used in the window (default: random)\n"
+              << "  --max-value v            largest generated value (default: 199, 1000000000 with --bench)\n"
+              << "  --bench                  run the benchmark without opening a window\n"
+              << "  --race                   race the --algorithms against each other on the same input, in a grid\n"
+              << "  --algorithms a,b,...     bubble, heap, quick, merge, selection, parallel-merge,\n"
+              << "                           parallel-quick, bottom-up-merge, intro, radix-lsd8, radix-lsd11,\n"
+              << "                           radix-lsd16, radix-msd, counting, tim (default: all)\n"
+              << "  --sizes n,m,...          array sizes, at most 268435456 (default: 1000,10000)\n"
+              << "  --distributions d,...    random, sorted, reversed, few-unique, nearly-sorted, gaussian,\n"
+              << "                           sorted-runs, sawtooth, duplicates (default: all)\n"
+              << "  --seed s                 seed for the input generator (default: 42, random in the window)\n"
+              << "  --threads n              threads used by the parallel algorithms (default: one per core)\n"
+              << "  --heap-arity d,...       children per heap node: 2, 4 or 8 (default: 2); the benchmark runs each\n"
+              << "  --bottom-up-heap         use Floyd's bottom-up sift in heap sort\n"
+              << "  --network n              sort ranges of up to n = 8, 16, 32 or 64 elements with a sorting network\n"
+              << "                           (default: off); the benchmark also runs without and reports the speedup\n"
+              << "  --key-types t,...        int, u64, float, string or record keys for the benchmark (default: int);\n"
+              << "                           only int keys are counted and sorted by the int-only algorithms\n"
+              << "  --format f               table, csv or json (default: table)\n"
+              << "  --output file            write the results to a file instead of stdout\n"
+              << "  --stats-file file        file the instrumentation overlay is appended to with O\n"
+              << "                           (default: instrumentation.txt)\n"
+              << "  --trace-file file        trace file saved with S and loaded with L (default: sort.trace)\n"
+              << "  --save-trace             record the sort of the first --algorithms entry straight to the\n"
+              << "                           --trace-file without opening the window, for sorts too long to replay\n"
+              << "  --export path            render the sort of the first --algorithms entry offscreen, to a Y4M\n"
+              << "                           video if path ends in .y4m, otherwise to path_000000.png, ...\n"
+              << "  --fps n                  frames per second of the export (default: 60)\n"
+              << "  --speed s                steps per second of the export (default: fits the sort in a minute)\n"
+              << "  --external file          sort a file of 32-bit integers larger than memory, showing its runs;\n"
+              << "                           with --bench it only prints the progress. Runs are sorted with the\n"
+              << "                           first --algorithms entry (default: intro)\n"
+              << "  --external-output file   where the sorted file goes (default: the input with .sorted appended)\n"
+              << "  --memory mb              memory the external sort may use, in MB (default: 512)\n";
+}
+
+// Returns false (after printing why) when the command line is not valid
+bool parseCommandLine(int argc, char **argv, CommandLineOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--help") {
+            options.help = true;
+        } else if (arg == "--bench") {
+            options.benchmark = true;
+        } else if (arg == "--race") {
+            options.race = true;
+        } else if (arg == "--algorithms" && hasValue) {
+            for (const std::string &name : splitList(argv[++i])) {
+                auto info = std::find_if(std::begin(ALGORITHMS), std::end(ALGORITHMS), [&](const AlgorithmInfo &a) { return name == a.option; });
+                if (info == std::end(ALGORITHMS)) {
+                    std::cerr << "Unknown algorithm: " << name << "\n";
+                    return false;
+                }
+                options.algorithms.push_back(info->algorithm);
+            }
+        } else if (arg == "--sizes" && hasValue) {
+            for (const std::string &size : splitList(argv[++i])) {
+                unsigned long long value;
+                if (!parseUnsigned(size, value) || value == 0) {
+                    std::cerr << "Invalid size: " << size << "\n";
+                    return false;
+                }
+                if (value > MAX_BENCHMARK_SIZE) {
+                    std::cerr << "Benchmark sizes can be at most " << MAX_BENCHMARK_SIZE << "\n";
+                    return false;
+                }
+                options.sizes.push_back(value);
+            }
+        } else if (arg == "--distributions" && hasValue) {
+            for (const std::string &name : splitList(argv[++i])) {
+                auto info = std::find_if(std::begin(DISTRIBUTIONS), std::end(DISTRIBUTIONS), [&](const DistributionInfo &d) { return name == d.option; });
+                if (info == std::end(DISTRIBUTIONS)) {
+                    std::cerr << "Unknown distribution: " << name << "\n";
+                    return false;
+                }
+                options.distributions.push_back(info->distribution);
+            }
+        } else if (arg == "--seed" && hasValue) {
+            unsigned long long seed;
+            if (!parseUnsigned(argv[++i], seed)) {
+                std::cerr << "Invalid seed: " << argv[i] << "\n";
+                return false;
+            }
+            options.seed = seed;
+            options.hasSeed = true;
+        } else if (arg == "--size" && hasValue) {
+            unsigned long long size;
+            if (!parseUnsigned(argv[++i], size) || size < MIN_ARRAY_SIZE || size > MAX_ARRAY_SIZE) {
+                std::cerr << "The size must be between " << MIN_ARRAY_SIZE << " and " << MAX_ARRAY_SIZE << "\n";
+                return false;
+            }
+            options.size = size;
+        } else if (arg == "--distribution" && hasValue) {
+            std::string name = argv[++i];
+            auto info = std::find_if(std::begin(DISTRIBUTIONS), std::end(DISTRIBUTIONS), [&](const DistributionInfo &d) { return name == d.option; });
+            if (info == std::end(DISTRIBUTIONS)) {
+                std::cerr << "Unknown distribution: " << name << "\n";
+                return false;
+            }
+            options.distribution = info->distribution;
+        } else if (arg == "--max-value" && hasValue) {
+            unsigned long long maxValue;
+            if (!parseUnsigned(argv[++i], maxValue) || maxValue == 0 || maxValue > INT_MAX) {
+                std::cerr << "The largest value must be between 1 and " << INT_MAX << "\n";
+                return false;
+            }
+            options.maxValue = maxValue;
+        } else if (arg == "--threads" && hasValue) {
+            unsigned long long threads;
+            if (!parseUnsigned(argv[++i], threads) || threads == 0 || threads > MAX_THREADS) {
+                std::cerr << "The thread count must be between 1 and " << MAX_THREADS << "\n";
+                return false;
+            }
+            options.sort.threads = threads;
+        } else if (arg == "--heap-arity" && hasValue) {
+            for (const std::string &value : splitList(argv[++i])) {
+                unsigned long long arity;
+                if (!parseUnsigned(value, arity) || (arity != 2 && arity != 4 && arity != 8)) {
+                    std::cerr << "The heap arity must be 2, 4 or 8\n";
+                    return false;
+                }
+                options.heapArities.push_back(arity);
+            }
+            if (!options.heapArities.empty())
+                options.sort.heapArity = options.heapArities.front();
+        } else if (arg == "--bottom-up-heap") {
+            options.sort.bottomUpHeap = true;
+        } else if (arg == "--network" && hasValue) {
+            unsigned long long block;
+            if (!parseUnsigned(argv[++i], block) || (block != 8 && block != 16 && block != 32 && block != 64)) {
+                std::cerr << "The network size must be 8, 16, 32 or 64\n";
+                return false;
+            }
+            options.sort.networkBlock = block;
+        } else if (arg == "--key-types" && hasValue) {
+            for (const std::string &name : splitList(argv[++i])) {
+                if (std::find(std::begin(KEY_TYPES), std::end(KEY_TYPES), name) == std::end(KEY_TYPES)) {
+                    std::cerr << "Unknown key type: " << name << "\n";
+                    return false;
+                }
+                options.keyTypes.push_back(name);
+            }
+        } else if (arg == "--format" && hasValue) {
+            options.format = argv[++i];
+            if (options.format != "table" && options.format != "csv" && options.format != "json") {
+                std::cerr << "Unknown format: " << options.format << "\n";
+                return false;
+            }
+        } else if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        } else if (arg == "--stats-file" && hasValue) {
+            options.statsFile = argv[++i];
+        } else if (arg == "--trace-file" && hasValue) {
+            options.traceFile = argv[++i];
+        } else if (arg == "--save-trace") {
+            options.saveTrace = true;
+        } else if (arg == "--export" && hasValue) {
+            options.exportPath = argv[++i];
+        } else if (arg == "--fps" && hasValue) {
+            unsigned long long fps;
+            if (!parseUnsigned(argv[++i], fps) || fps == 0 || fps > MAX_FPS) {
+                std::cerr << "The frame rate must be between 1 and " << MAX_FPS << "\n";
+                return false;
+            }
+            options.fps = fps;
+        } else if (arg == "--external" && hasValue) {
+            options.externalInput = argv[++i];
+        } else if (arg == "--external-output" && hasValue) {
+            options.externalOutput = argv[++i];
+        } else if (arg == "--memory" && hasValue) {
+            unsigned long long memory;
+            if (!parseUnsigned(argv[++i], memory) || memory < 4 || memory > MAX_EXTERNAL_MEMORY) {
+                std::cerr << "The external sort memory must be between 4 and " << MAX_EXTERNAL_MEMORY << " MB\n";
+                return false;
+            }
+            options.memory = memory;
+        } else if (arg == "--speed" && hasValue) {
+            float speed;
+            if (!parseFloat(argv[++i], speed) || speed <= 0.0f || speed > MAX_EXPORT_SPEED) {
+                std::cerr << "The speed must be positive and at most " << (long long)MAX_EXPORT_SPEED << " steps per second\n";
+                return false;
+            }
+            options.exportSpeed = speed;
+        } else {
+            std::cerr << "Unknown option: " << arg << "\n";
+            printUsage(argv[0]);
+            return false;
+        }
+    }
 
-// Util functions (mainly display)
-sf::Color getColor(int value) {
-    int r = (value * 23) % 256;
-    int g = (value * 59) % 256;
-    int b = (value * 97) % 256;
-    return sf::Color(r, g, b);
+    if (!options.algorithms.empty())
+        options.externalAlgorithm = options.algorithms.front();
+    if (options.algorithms.empty())
+        for (const AlgorithmInfo &info : ALGORITHMS)
+            options.algorithms.push_back(info.algorithm);
+    if (options.sizes.empty())
+        options.sizes = {1000, 10000};
+    if (options.distributions.empty())
+        for (const DistributionInfo &info : DISTRIBUTIONS)
+            options.distributions.push_back(info.distribution);
+    if (options.heapArities.empty())
+        options.heapArities = {options.sort.heapArity};
+    if (options.keyTypes.empty())
+        options.keyTypes = {"int"};
+    return true;
 }
 
-void visualizeArray(sf::RenderWindow &window, const std::vector<int> &array, const sf::Font &font, const sf::Text &text, const std::map<int, sf::Color> &partitionColors = {}) {
-    window.clear();
-
-    float barWidth = 10.0f;
-    float spacing = 2.0f;
-    float totalWidth = array.size() * (barWidth + spacing) - spacing;
-    float startX = (WINDOW_WIDTH - totalWidth) / 2;
-
-    for (size_t i = 0; i < array.size(); ++i) {
-        sf::RectangleShape bar(sf::Vector2f(barWidth, array[i]));
-        bar.setPosition(startX + i * (barWidth + spacing), WINDOW_HEIGHT - array[i]);
-
-        if (partitionColors.find(i) != partitionColors.end()) {
-            bar.setFillColor(partitionColors.at(i));
-        } else {
-            bar.setFillColor(getColor(array[i]));
+void writeResults(std::ostream &out, const std::vector<BenchmarkResult> &results, const std::string &format) {
+    if (format == "csv") {
+        out << "algorithm,distribution,size,time_ms,comparisons,swaps,writes,peak_extra_bytes,sorted,network,speedup,l1d_misses,cache_misses,branch_misses\n";
+        for (const BenchmarkResult &r : results) {
+            out << r.algorithm << ',' << r.distribution << ',' << r.size << ',' << r.milliseconds << ','
+                << (r.counted ? std::to_string(r.comparisons) + ',' + std::to_string(r.swaps) + ',' + std::to_string(r.writes) + ','
+                                  + std::to_string(r.peakExtraBytes) : std::string(",,,")) << ','
+                << (r.sorted ? "yes" : "no") << ',' << r.networkBlock << ',';
+            if (r.speedup > 0)
+                out << r.speedup;
+            out << ',';
+            if (r.l1Misses >= 0)
+                out << r.l1Misses;
+            out << ',';
+            if (r.cacheMisses >= 0)
+                out << r.cacheMisses;
+            out << ',';
+            if (r.branchMisses >= 0)
+                out << r.branchMisses;
+            out << "\n";
+        }
+    } else if (format == "json") {
+        out << "[\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchmarkResult &r = results[i];
+            out << "  {\"algorithm\": \"" << r.algorithm << "\", \"distribution\": \"" << r.distribution
+                << "\", \"size\": " << r.size << ", \"time_ms\": " << r.milliseconds;
+            if (r.counted)
+                out << ", \"comparisons\": " << r.comparisons << ", \"swaps\": " << r.swaps
+                    << ", \"writes\": " << r.writes << ", \"peak_extra_bytes\": " << r.peakExtraBytes;
+            else
+                out << ", \"comparisons\": null, \"swaps\": null, \"writes\": null, \"peak_extra_bytes\": null";
+            out << ", \"sorted\": " << (r.sorted ? "true" : "false") << ", \"network\": " << r.networkBlock
+                << ", \"speedup\": ";
+            if (r.speedup > 0)
+                out << r.speedup;
+            else
+                out << "null";
+            out << ", \"l1d_misses\": ";
+            if (r.l1Misses >= 0)
+                out << r.l1Misses;
+            else
+                out << "null";
+            out << ", \"cache_misses\": ";
+            if (r.cacheMisses >= 0)
+                out << r.cacheMisses;
+            else
+                out << "null";
+            out << ", \"branch_misses\": ";
+            if (r.branchMisses >= 0)
+                out << r.branchMisses;
+            else
+                out << "null";
+            out << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "]\n";
+    } else {
+        out << std::left << std::setw(24) << "algorithm" << std::setw(15) << "distribution"
+            << std::right << std::setw(10) << "size" << std::setw(12) << "time (ms)"
+            << std::setw(15) << "comparisons" << std::setw(15) << "swaps" << std::setw(15) << "writes"
+            << std::setw(14) << "extra bytes" << std::setw(8) << "sorted" << std::setw(9) << "network"
+            << std::setw(9) << "speedup" << std::setw(14) << "L1d misses" << std::setw(14) << "cache misses"
+            << std::setw(15) << "branch misses" << "\n";
+        for (const BenchmarkResult &r : results) {
+            out << std::left << std::setw(24) << r.algorithm << std::setw(15) << r.distribution
+                << std::right << std::setw(10) << r.size << std::setw(12) << std::fixed << std::setprecision(3) << r.milliseconds;
+            if (r.counted)
+                out << std::setw(15) << r.comparisons << std::setw(15) << r.swaps << std::setw(15) << r.writes
+                    << std::setw(14) << r.peakExtraBytes;
+            else
+                out << std::setw(15) << "-" << std::setw(15) << "-" << std::setw(15) << "-" << std::setw(14) << "-";
+            out << std::setw(8) << (r.sorted ? "yes" : "no");
+            if (r.networkBlock > 0)
+                out << std::setw(9) << r.networkBlock;
+            else
+                out << std::setw(9) << "-";
+            if (r.speedup > 0)
+                out << std::setw(8) << std::setprecision(2) << r.speedup << "x";
+            else
+                out << std::setw(9) << "-";
+            for (std::int64_t misses : {r.l1Misses, r.cacheMisses}) {
+                if (misses >= 0)
+                    out << std::setw(14) << misses;
+                else
+                    out << std::setw(14) << "-";
+            }
+            if (r.branchMisses >= 0)
+                out << std::setw(15) << r.branchMisses;
+            else
+                out << std::setw(15) << "-";
+            out << "\n";
         }
-        window.draw(bar);
     }
-    window.draw(text);
-    window.display();
 }
 
-void drawArray(sf::RenderWindow &window, const std::vector<int> &array, const sf::Font &font) {
-    float squareSize = 30.0f;
-    float startX = (WINDOW_WIDTH - array.size() * squareSize) / 2;
-    float startY = WINDOW_HEIGHT - 100.0f;
+// Times sortRange on a copy of keys and checks the result. Nothing is recorded, so only the
+// time and the hardware counters are filled in.
+template <typename Key, typename Compare = std::less<>, typename Projection = Identity>
+void timeSortRange(SortAlgorithm algorithm, std::vector<Key> keys, const SortOptions &sort, PerfCounters &perfCounters,
+                   BenchmarkResult &result, Compare comp = Compare(), Projection proj = Projection()) {
+    perfCounters.start();
+    auto start = std::chrono::steady_clock::now();
+    sortRange(algorithm, keys.begin(), keys.end(), comp, proj, sort);
+    auto end = std::chrono::steady_clock::now();
+    perfCounters.stop();
 
-    for (size_t i = 0; i < array.size(); ++i) {
-        sf::RectangleShape square(sf::Vector2f(squareSize, squareSize));
-        square.setFillColor(getColor(array[i]));
-        square.setOutlineThickness(2);
-        square.setOutlineColor(sf::Color::Black);
-        square.setPosition(startX + i * squareSize, startY);
+    result.milliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+    result.comparisons = result.swaps = result.writes = 0;
+    result.peakExtraBytes = 0;
+    result.sorted = std::is_sorted(keys.begin(), keys.end(), ProjectedLess<Compare, Projection>{comp, proj});
+    result.counted = false;
+}
 
-        sf::Text valueText;
-        valueText.setFont(font);
-        valueText.setString(std::to_string(array[i]));
-        valueText.setCharacterSize(14);
-        valueText.setFillColor(sf::Color::Black);
-        valueText.setPosition(startX + i * squareSize + 5, startY + 5);
-        window.draw(square);
-        window.draw(valueText);
+// Builds keys of the given type from the int input, keeping its order, and times them
+void timeKeys(SortAlgorithm algorithm, const std::string &keyType, const std::vector<int> &input, const SortOptions &sort,
+              PerfCounters &perfCounters, BenchmarkResult &result) {
+    if (keyType == "u64") {
+        std::vector<std::uint64_t> keys(input.begin(), input.end());
+        for (std::uint64_t &key : keys)
+            key <<= 24;
+        timeSortRange(algorithm, std::move(keys), sort, perfCounters, result);
+    } else if (keyType == "float") {
+        std::vector<float> keys(input.size());
+        std::transform(input.begin(), input.end(), keys.begin(), [](int value) { return value * 0.5f; });
+        timeSortRange(algorithm, std::move(keys), sort, perfCounters, result);
+    } else if (keyType == "string") {
+        // Views into strings that outlive the sort, compared lexicographically
+        std::vector<std::string> storage(input.size());
+        std::transform(input.begin(), input.end(), storage.begin(), [](int value) { return std::to_string(value); });
+        std::vector<std::string_view> keys(storage.begin(), storage.end());
+        timeSortRange(algorithm, std::move(keys), sort, perfCounters, result);
+    } else if (keyType == "record") {
+        std::vector<Record> keys(input.size());
+        for (size_t i = 0; i < input.size(); ++i)
+            keys[i] = {input[i], (std::uint32_t)i};
+        timeSortRange(algorithm, std::move(keys), sort, perfCounters, result, std::less<>(), &Record::key);
     }
 }
 
+// Runs timed per variant when the benchmark reports a network speedup
+const int SPEEDUP_REPEATS = 3;
 
-void visualizeBarsAndArrayMerge(sf::RenderWindow &window, const std::vector<int> &array, const sf::Font &font, const sf::Text &text, int pivotIndex = -1, int leftIndex = -1, int rightIndex = -1) {
-    window.clear();
-    float barWidth = 10.0f;
-    float spacing = 2.0f;
-    float totalWidth = array.size() * (barWidth + spacing) - spacing;
-    float startX = (WINDOW_WIDTH - totalWidth) / 2;
+int runBenchmark(const CommandLineOptions &options) {
+    std::vector<BenchmarkResult> results;
+    PerfCounters perfCounters;
 
-    // Draw bars
-    for (size_t i = 0; i < array.size(); ++i) {
-        sf::RectangleShape bar(sf::Vector2f(10, array[i]));
-        bar.setPosition(startX + i * (barWidth + spacing), 400 - array[i]);
-
-        if (i == pivotIndex) {
-            bar.setFillColor(sf::Color::Red);
-        } else if (i == leftIndex || i == rightIndex) {
-            bar.setFillColor(sf::Color::Green);
-        } else {
-            bar.setFillColor(sf::Color::White);
+    for (SortAlgorithm algorithm : options.algorithms) {
+        const AlgorithmInfo &info = *std::find_if(std::begin(ALGORITHMS), std::end(ALGORITHMS), [&](const AlgorithmInfo &a) { return a.algorithm == algorithm; });
+        for (const std::string &keyType : options.keyTypes)
+            if (keyType != "int" && !isGeneric(algorithm))
+                std::cerr << info.option << " only sorts int keys, skipping " << keyType << "\n";
+        for (Distribution distribution : options.distributions) {
+            for (size_t size : options.sizes) {
+                std::vector<int> input = generateInput(distribution, size, options.seed, options.maxValue > 0 ? options.maxValue : 1000000000);
+
+                // With --network, algorithms that can use it run once without it first for reference
+                std::vector<SortOptions> runs;
+                if (options.sort.networkBlock > 0 && usesNetworks(algorithm)) {
+                    runs.push_back(options.sort);
+                    runs.back().networkBlock = 0;
+                }
+                runs.push_back(options.sort);
+                if (!usesNetworks(algorithm))
+                    runs.back().networkBlock = 0;
+                // Heap sort runs once per arity given with --heap-arity
+                if (algorithm == HEAP_SORT) {
+                    runs.clear();
+                    for (int arity : options.heapArities) {
+                        runs.push_back(options.sort);
+                        runs.back().networkBlock = 0;
+                        runs.back().heapArity = arity;
+                    }
+                }
+
+                // A speedup is a ratio of two timings, so both sides get the best of a few runs
+                int repeats = options.sort.networkBlock > 0 && usesNetworks(algorithm) ? SPEEDUP_REPEATS : 1;
+                for (const std::string &keyType : options.keyTypes) {
+                    if (keyType != "int" && !isGeneric(algorithm))
+                        continue;
+                    double baseline = 0.0;
+                    for (const SortOptions &sort : runs) {
+                        BenchmarkResult result;
+                        if (keyType == "int") {
+                            std::vector<int> array;
+                            StepTrace counters(false);
+                            for (int repeat = 0; repeat < repeats; ++repeat) {
+                                array = input;
+                                counters = StepTrace(false);
+
+                                perfCounters.start();
+                                auto start = std::chrono::steady_clock::now();
+                                runAlgorithm(algorithm, array, counters, sort);
+                                auto end = std::chrono::steady_clock::now();
+                                perfCounters.stop();
+
+                                double milliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+                                if (repeat == 0 || milliseconds < result.milliseconds)
+                                    result.milliseconds = milliseconds;
+                            }
+                            result.comparisons = counters.getComparisons();
+                            result.swaps = counters.getSwaps();
+                            result.writes = counters.getWrites();
+                            result.peakExtraBytes = counters.getPeakExtraBytes();
+                            result.sorted = std::is_sorted(array.begin(), array.end());
+                            result.counted = true;
+                        } else {
+                            for (int repeat = 0; repeat < repeats; ++repeat) {
+                                BenchmarkResult attempt;
+                                timeKeys(algorithm, keyType, input, sort, perfCounters, attempt);
+                                if (repeat == 0 || attempt.milliseconds < result.milliseconds)
+                                    result = attempt;
+                            }
+                        }
+
+                        result.algorithm = info.option;
+                        if (algorithm == HEAP_SORT && sort.heapArity != 2)
+                            result.algorithm += "/" + std::to_string(sort.heapArity);
+                        if (algorithm == HEAP_SORT && sort.bottomUpHeap)
+                            result.algorithm += "/floyd";
+                        if (algorithm == COUNTING_SORT && countingSortFallsBack(input))
+                            result.algorithm += "/lsd16";
+                        if (keyType != "int")
+                            result.algorithm += "/" + keyType;
+                        result.distribution = DISTRIBUTIONS[distribution].option;
+                        result.size = size;
+                        result.networkBlock = sort.networkBlock;
+                        result.speedup = sort.networkBlock > 0 && baseline > 0 ? baseline / result.milliseconds : 0.0;
+                        result.l1Misses = perfCounters.getL1Misses();
+                        result.cacheMisses = perfCounters.getCacheMisses();
+                        result.branchMisses = perfCounters.getBranchMisses();
+                        if (sort.networkBlock == 0)
+                            baseline = result.milliseconds;
+                        results.push_back(result);
+                        std::cerr << result.algorithm << " / " << result.distribution << " / " << size;
+                        if (sort.networkBlock > 0)
+                            std::cerr << " / network " << sort.networkBlock;
+                        std::cerr << ": " << result.milliseconds << " ms\n";
+                    }
+                }
+            }
         }
+    }
 
-        window.draw(bar);
+    if (options.output.empty()) {
+        writeResults(std::cout, results, options.format);
+    } else {
+        std::ofstream file(options.output);
+        if (!file) {
+            std::cerr << "Cannot open " << options.output << " for writing\n";
+            return 1;
+        }
+        writeResults(file, results, options.format);
     }
+    return 0;
+}
 
-    // Draw array as squares
-    float squareSize = 30.0f;
-    startX = (WINDOW_WIDTH - array.size() * squareSize) / 2;
-    float startY = WINDOW_HEIGHT - 100.0f;
 
-    for (size_t i = 0; i < array.size(); ++i) {
-        sf::RectangleShape square(sf::Vector2f(squareSize, squareSize));
-        square.setFillColor(sf::Color::White);
-        square.setOutlineThickness(2);
-        square.setOutlineColor(sf::Color::Black);
-        square.setPosition(startX + i * squareSize, startY);
+// Two-line title: the algorithm, then the input it is about to sort
+void setTitle(sf::Text &text, SortAlgorithm algorithm, size_t size, Distribution distribution, std::uint64_t seed, const SortOptions &sort) {
+    const AlgorithmInfo &info = *std::find_if(std::begin(ALGORITHMS), std::end(ALGORITHMS), [&](const AlgorithmInfo &a) { return a.algorithm == algorithm; });
+    std::string name = info.name;
+    if (sort.networkBlock > 0 && usesNetworks(algorithm))
+        name += " + " + std::to_string(sort.networkBlock) + "-key networks";
+    if (algorithm == HEAP_SORT && (sort.heapArity != 2 || sort.bottomUpHeap))
+        name += " (" + std::to_string(sort.heapArity) + "-ary" + (sort.bottomUpHeap ? ", bottom-up)" : ")");
+    text.setString("Current Algorithm: " + name + "\n" + std::to_string(size) + " elements, "
+                   + DISTRIBUTIONS[distribution].option + ", seed " + std::to_string(seed));
+}
 
-        sf::Text valueText;
-        valueText.setFont(font);
-        valueText.setString(std::to_string(array[i]));
-        valueText.setCharacterSize(14);
-        valueText.setFillColor(sf::Color::Black);
-        valueText.setPosition(startX + i * squareSize + 5, startY + 5);
+// Offscreen export
+// Frames are read back from a render texture into a ring of reused pixel buffers. Encoder
+// threads turn them into PNG files or one Y4M stream while the next frames are drawn.
+class FrameExporter {
+public:
+    // A path ending in .y4m gives a Y4M stream, anything else is the prefix of a PNG sequence
+    FrameExporter(const std::string &path, unsigned width, unsigned height, int fps, size_t ringSize = 8)
+        : path(path), width(width), height(height), fps(fps), slots(ringSize) {
+        y4m = path.size() >= 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+        for (Slot &slot : slots)
+            slot.pixels.resize((size_t)width * height * 4);
+    }
+    ~FrameExporter() { finish(); }
+    FrameExporter(const FrameExporter &) = delete;
+    FrameExporter &operator=(const FrameExporter &) = delete;
 
-        window.draw(square);
-        window.draw(valueText);
+    // Returns false (after printing why) when the output cannot be created
+    bool open() {
+        if (y4m) {
+            stream.open(path, std::ios::binary);
+            if (!stream) {
+                std::cerr << "Cannot open " << path << " for writing\n";
+                return false;
+            }
+            stream << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C420jpeg\n";
+        }
+        for (size_t i = 0; i < slots.size(); ++i)
+            freeSlots.push_back(i);
+        // Y4M frames have to be written in order, PNG files can be compressed side by side
+        unsigned count = y4m ? 1 : std::max(2u, std::thread::hardware_concurrency()) - 1;
+        for (unsigned i = 0; i < count; ++i)
+            encoders.emplace_back([this] { encode(); });
+        return true;
     }
 
-    window.draw(text);
-    window.display();
-}
+    // Copies the texture's pixels into a free buffer and queues it. Waits while all the
+    // buffers are queued, so a slow encoder holds back the renderer instead of using memory.
+    void capture(sf::RenderTexture &texture) {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            slotFreed.wait(lock, [this] { return !freeSlots.empty(); });
+            index = freeSlots.front();
+            freeSlots.pop_front();
+        }
+        texture.setActive(true);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, slots[index].pixels.data());
+        slots[index].frame = frames++;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            readySlots.push_back(index);
+        }
+        frameReady.notify_one();
+    }
 
+    // Waits until every queued frame is written; returns false if any of them failed
+    bool finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        frameReady.notify_all();
+        for (std::thread &encoder : encoders)
+            encoder.join();
+        encoders.clear();
+        if (stream.is_open()) {
+            stream.close();
+            if (stream.fail())
+                failed = true;
+        }
+        return !failed;
+    }
 
+    size_t getFrames() const { return frames; }
 
-void visualizeBarsAndArray(sf::RenderWindow &window, const std::vector<int> &array, const sf::Font &font, const sf::Text &text, const std::map<int, sf::Color> &partitionColors = {}) {
-    window.clear();
-    
-    float barWidth = 10.0f;
-    float spacing = 2.0f;
-    float totalWidth = array.size() * (barWidth + spacing) - spacing;
-    float startX = (WINDOW_WIDTH - totalWidth) / 2;
+private:
+    struct Slot {
+        std::vector<sf::Uint8> pixels; // RGBA, bottom row first as OpenGL reads it
+        size_t frame = 0;
+    };
 
-    // Draw bars
-    for (size_t i = 0; i < array.size(); ++i) {
-        sf::RectangleShape bar(sf::Vector2f(barWidth, array[i]));
-        bar.setPosition(startX + i * (barWidth + spacing), 400 - array[i]); 
+    void encode() {
+        std::vector<sf::Uint8> converted;
+        sf::Image image;
+        while (true) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frameReady.wait(lock, [this] { return closing || !readySlots.empty(); });
+                if (readySlots.empty())
+                    return;
+                index = readySlots.front();
+                readySlots.pop_front();
+            }
 
-        if (partitionColors.find(i) != partitionColors.end()) {
-            bar.setFillColor(partitionColors.at(i));
-        } else {
-            bar.setFillColor(getColor(array[i]));
+            // The buffer goes back to the ring as soon as it is converted, before the slow part
+            size_t frame = slots[index].frame;
+            if (y4m)
+                toYuv420(slots[index].pixels, converted);
+            else
+                flipRows(slots[index].pixels, converted);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                freeSlots.push_back(index);
+            }
+            slotFreed.notify_one();
+
+            bool written;
+            if (y4m) {
+                stream << "FRAME\n";
+                stream.write((const char *)converted.data(), converted.size());
+                written = (bool)stream;
+            } else {
+                std::ostringstream name;
+                name << path << '_' << std::setw(6) << std::setfill('0') << frame << ".png";
+                image.create(width, height, converted.data());
+                written = image.saveToFile(name.str());
+            }
+            if (!written) {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+            }
         }
+    }
 
-        window.draw(bar);
+    void flipRows(const std::vector<sf::Uint8> &pixels, std::vector<sf::Uint8> &out) const {
+        size_t rowBytes = (size_t)width * 4;
+        out.resize(pixels.size());
+        for (unsigned y = 0; y < height; ++y)
+            std::copy_n(&pixels[(height - 1 - y) * rowBytes], rowBytes, &out[y * rowBytes]);
     }
 
-    // Draw array as squares
-    float squareSize = 30.0f;
-    startX = (WINDOW_WIDTH - array.size() * squareSize) / 2;
-    float startY = WINDOW_HEIGHT - 100.0f;
-
-    for (size_t i = 0; i < array.size(); ++i) {
-        sf::RectangleShape square(sf::Vector2f(squareSize, squareSize));
-        if (partitionColors.find(i) != partitionColors.end()) {
-            square.setFillColor(partitionColors.at(i));
-        } else {
-            square.setFillColor(getColor(array[i]));
+    // BT.601 studio range, one chroma sample per 2x2 block (width and height are even)
+    void toYuv420(const std::vector<sf::Uint8> &pixels, std::vector<sf::Uint8> &out) const {
+        size_t lumaSize = (size_t)width * height;
+        out.resize(lumaSize + lumaSize / 2);
+        sf::Uint8 *luma = out.data();
+        sf::Uint8 *cb = luma + lumaSize;
+        sf::Uint8 *cr = cb + lumaSize / 4;
+        for (unsigned y = 0; y < height; ++y) {
+            const sf::Uint8 *row = &pixels[(size_t)(height - 1 - y) * width * 4];
+            for (unsigned x = 0; x < width; ++x) {
+                int r = row[x * 4], g = row[x * 4 + 1], b = row[x * 4 + 2];
+                luma[(size_t)y * width + x] = (sf::Uint8)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            }
+        }
+        for (unsigned y = 0; y < height; y += 2) {
+            const sf::Uint8 *top = &pixels[(size_t)(height - 1 - y) * width * 4];
+            const sf::Uint8 *bottom = top - (size_t)width * 4;
+            for (unsigned x = 0; x < width; x += 2) {
+                int r = top[x * 4] + top[x * 4 + 4] + bottom[x * 4] + bottom[x * 4 + 4];
+                int g = top[x * 4 + 1] + top[x * 4 + 5] + bottom[x * 4 + 1] + bottom[x * 4 + 5];
+                int b = top[x * 4 + 2] + top[x * 4 + 6] + bottom[x * 4 + 2] + bottom[x * 4 + 6];
+                size_t i = (size_t)(y / 2) * (width / 2) + x / 2;
+                cb[i] = (sf::Uint8)(((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128);
+                cr[i] = (sf::Uint8)(((112 * r - 94 * g - 18 * b + 512) >> 10) + 128);
+            }
         }
-        square.setOutlineThickness(2);
-        square.setOutlineColor(sf::Color::Black);
-        square.setPosition(startX + i * squareSize, startY);
+    }
+
+    std::string path;
+    unsigned width, height;
+    int fps;
+    bool y4m;
+    std::ofstream stream;
+    std::vector<Slot> slots;
+    size_t frames = 0;
+
+    std::mutex mutex;
+    std::condition_variable slotFreed;
+    std::condition_variable frameReady;
+    std::deque<size_t> freeSlots;
+    std::deque<size_t> readySlots; // in capture order
+    std::vector<std::thread> encoders;
+    bool closing = false;
+    bool failed = false;
+};
+
+// Records the sort of the first --algorithms entry straight into the trace file, on the array
+// the window would start with. Nothing is replayed, so the trace only costs disk space.
+int runSaveTrace(const CommandLineOptions &options) {
+    SortAlgorithm algorithm = options.algorithms.front();
+    int maxValue = options.maxValue > 0 ? options.maxValue : 199;
+    std::vector<int> array = generateInput(options.distribution, options.size, options.seed, maxValue);
+
+    TraceHeader header{};
+    header.algorithm = algorithm;
+    header.seed = options.seed;
+    header.distribution = options.distribution;
+    header.heapArity = options.sort.heapArity;
+    header.bottomUpHeap = options.sort.bottomUpHeap;
+    header.networkBlock = options.sort.networkBlock;
+    TraceWriter writer;
+    if (!writer.open(options.traceFile, header, array))
+        return 1;
+
+    auto start = std::chrono::steady_clock::now();
+    StepTrace trace;
+    trace.setSink(&writer);
+    runAlgorithm(algorithm, array, trace, options.sort);
+    size_t steps = writer.size();
+    if (!writer.finish())
+        return 1;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Saved " << steps << " steps to " << options.traceFile << " in " << seconds << " s\n";
+    return 0;
+}
+
+// Records the sort of the first --algorithms entry, then replays it into a render texture at
+// a fixed frame rate. Nothing waits for a clock, so the export runs as fast as rendering and
+// encoding allow.
+int runExport(const CommandLineOptions &options) {
+    SortAlgorithm algorithm = options.algorithms.front();
+    int maxValue = options.maxValue > 0 ? options.maxValue : 199;
+    std::vector<int> input = generateInput(options.distribution, options.size, options.seed, maxValue);
+    std::vector<int> array = input;
+    StepTrace trace;
+    runAlgorithm(algorithm, array, trace, options.sort);
+    TracePlayer player;
+    player.load(input, std::move(trace));
+    player.setSpeed(options.exportSpeed > 0.0f ? options.exportSpeed : std::max(20.0f, player.getLength() / 60.0f));
+
+    sf::RenderTexture texture;
+    if (!texture.create(WINDOW_WIDTH, WINDOW_HEIGHT)) {
+        std::cerr << "Cannot create a " << WINDOW_WIDTH << "x" << WINDOW_HEIGHT << " render texture\n";
+        return 1;
+    }
+    sf::Font font;
+    if (!font.loadFromFile("arial.ttf")) {
+        return 1;
+    }
+    sf::Text text;
+    text.setFont(font);
+    text.setCharacterSize(24);
+    text.setFillColor(sf::Color::White);
+    text.setPosition(10, 10);
+    setTitle(text, algorithm, options.size, options.distribution, options.seed, options.sort);
 
-        sf::Text valueText;
-        valueText.setFont(font);
-        valueText.setString(std::to_string(array[i]));
-        valueText.setCharacterSize(14);
-        valueText.setFillColor(sf::Color::Black);
-        valueText.setPosition(startX + i * squareSize + 5, startY + 5);
+    BarRenderer bars(400, 320);
+    LabelLayer labels(font, WINDOW_HEIGHT - 100.0f);
+    HeapRenderer heap(font, 85.0f, WINDOW_HEIGHT - 110.0f);
+    HighlightBuffer highlights;
 
-        window.draw(square);
-        window.draw(valueText);
+    FrameExporter exporter(options.exportPath, WINDOW_WIDTH, WINDOW_HEIGHT, options.fps);
+    if (!exporter.open())
+        return 1;
+
+    auto start = std::chrono::steady_clock::now();
+    renderPlayer(texture, bars, labels, heap, highlights, player, algorithm, options.sort, text);
+    texture.display();
+    exporter.capture(texture);
+    while (!player.finished()) {
+        player.update(1.0f / options.fps);
+        renderPlayer(texture, bars, labels, heap, highlights, player, algorithm, options.sort, text);
+        texture.display();
+        exporter.capture(texture);
+        if (exporter.getFrames() % (options.fps * 10) == 0)
+            std::cerr << "step " << player.getPosition() << " of " << player.getLength() << "\n";
     }
+    // Hold the sorted array for a second
+    for (int i = 0; i < options.fps; ++i)
+        exporter.capture(texture);
+    bool written = exporter.finish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    window.draw(text);
-    window.display();
+    std::cerr << "Exported " << exporter.getFrames() << " frames (" << exporter.getFrames() / options.fps
+              << " s of video) in " << seconds << " s\n";
+    if (!written)
+        std::cerr << "Some frames could not be written to " << options.exportPath << "\n";
+    return written ? 0 : 1;
 }
 
-void visualizeHeap(sf::RenderWindow &window, const std::vector<int> &array, const sf::Font &font, const sf::Text &text, int sortedIndex) {
-    window.clear();
+// Race mode
+// Every algorithm sorts its own copy of the same input on its own SortWorker. The lanes share
+// one clock counted in operations (comparisons, swaps and writes), so in every frame each lane
+// does the same amount of work, and the grid shows which algorithm needs the least of it.
+// A lane takes from its worker only what the clock has reached and frees what it has played,
+// so a million-element race holds a few queues' worth of steps, not whole traces.
+class RaceLane {
+public:
+    RaceLane(SortAlgorithm algorithm, const sf::Font &font)
+        : algorithm(algorithm), labels(font, WINDOW_HEIGHT - 100.0f), heap(font, 85.0f, WINDOW_HEIGHT - 110.0f) {}
 
-    int n = sortedIndex;
-    float nodeRadius = 20.0f;
-    float hGap = 40.0f;
-    float vGap = 60.0f;
+    // The lane is drawn full size into its own texture, then scaled down into its cell
+    bool createTexture() {
+        if (!texture.create(WINDOW_WIDTH, WINDOW_HEIGHT))
+            return false;
+        texture.setSmooth(true);
+        return true;
+    }
 
-    std::vector<sf::Vector2f> positions(n);
-    for (int i = 0; i < n; ++i) {
-        float x = WINDOW_WIDTH / 2 + (i - (n / 2)) * hGap;
-        float y = 100 + (int)(log2(i + 1)) * vGap;
-        positions[i] = sf::Vector2f(x, y);
+    void start(const std::vector<int> &input, const SortOptions &options) {
+        worker.cancel();
+        player.load(input, StepTrace());
+        worker.start(algorithm, input, options);
+        operations = 0;
+        finishedAt = 0;
+        rank = 0;
+        dirty = true;
     }
 
-    // Draw lines first
-    for (int i = 0; i < n; ++i) {
-        if (i > 0) {
-            int parent = (i - 1) / 2;
-            sf::Vertex line[] = {
-                sf::Vertex(positions[parent]),
-                sf::Vertex(positions[i])
-            };
-            window.draw(line, 2, sf::Lines);
+    // Plays the lane up to the shared clock
+    void advance(std::uint64_t clock) {
+        while (operations < clock) {
+            if (!player.stepForward()) {
+                // Out of steps, or in the middle of a batch that is still streaming in
+                bool running = worker.isRunning();
+                worker.drain(player, 1 << 16);
+                if (!player.stepForward()) {
+                    if (!running)
+                        finishedAt = std::max<std::uint64_t>(operations, 1);
+                    break;
+                }
+            }
+            const Step *first = nullptr;
+            size_t batch = player.lastBatch(first);
+            if (batch == 0)
+                operations += countsAsOperation(*player.lastStep());
+            else
+                for (size_t i = 0; i < batch; ++i)
+                    operations += countsAsOperation(first[i]);
+            dirty = true;
         }
+        player.trim();
     }
 
-    for (int i = 0; i < n; ++i) {
-        float x = positions[i].x;
-        float y = positions[i].y;
+    // Redraws the lane's texture if it changed since the last frame
+    void render(const SortOptions &options) {
+        if (!dirty)
+            return;
+        renderPlayer(texture, bars, labels, heap, highlights, player, algorithm, options, sf::Text());
+        texture.display();
+        dirty = false;
+    }
+
+    SortAlgorithm getAlgorithm() const { return algorithm; }
+    std::uint64_t getOperations() const { return operations; }
+    std::uint64_t getFinishedAt() const { return finishedAt; }
+    bool isFinished() const { return finishedAt > 0; }
+    int getRank() const { return rank; }
+    void setRank(int place) { rank = place; }
+    const sf::Texture &getTexture() const { return texture.getTexture(); }
 
-        sf::CircleShape node(nodeRadius);
-        node.setFillColor(getColor(array[i]));
-        node.setOutlineThickness(2);
-        node.setOutlineColor(sf::Color::Black);
-        node.setPosition(x - nodeRadius, y - nodeRadius);
+private:
+    static bool countsAsOperation(const Step &step) {
+        return step.type == STEP_COMPARE || step.type == STEP_SWAP || step.type == STEP_WRITE;
+    }
 
-        sf::Text nodeValue;
-        nodeValue.setFont(font);
-        nodeValue.setString(std::to_string(array[i]));
-        nodeValue.setCharacterSize(14);
-        nodeValue.setFillColor(sf::Color::Black);
-        nodeValue.setPosition(x - nodeRadius / 2, y - nodeRadius / 2);
+    SortAlgorithm algorithm;
+    SortWorker worker;
+    TracePlayer player;
+    BarRenderer bars{400, 320};
+    LabelLayer labels;
+    HeapRenderer heap;
+    HighlightBuffer highlights;
+    sf::RenderTexture texture;
+    std::uint64_t operations = 0;
+    std::uint64_t finishedAt = 0; // operations when the sort ended, 0 = still running
+    int rank = 0;
+    bool dirty = true;
+};
 
-        window.draw(node);
-        window.draw(nodeValue);
+int runRace(const CommandLineOptions &options) {
+    sf::RenderWindow window(sf::VideoMode(WINDOW_WIDTH, WINDOW_HEIGHT), "Algorithm Visualizer");
+    window.setFramerateLimit(60);
+    sf::Font font;
+    if (!font.loadFromFile("arial.ttf")) {
+        return -1;
     }
 
-    drawArray(window, array, font);
+    std::uint64_t seed = options.hasSeed ? options.seed : std::time(0);
+    size_t arraySize = options.size;
+    Distribution distribution = options.distribution;
+    int maxValue = options.maxValue > 0 ? options.maxValue : 199;
+    std::vector<int> input = generateInput(distribution, arraySize, seed, maxValue);
 
-    window.draw(text);
-    window.display();
-}
+    std::vector<std::unique_ptr<RaceLane>> lanes;
+    for (SortAlgorithm algorithm : options.algorithms) {
+        lanes.push_back(std::make_unique<RaceLane>(algorithm, font));
+        if (!lanes.back()->createTexture()) {
+            std::cerr << "Cannot create a " << WINDOW_WIDTH << "x" << WINDOW_HEIGHT << " render texture\n";
+            return 1;
+        }
+    }
 
-// Sorting functions
-void heapify(std::vector<int> &array, int n, int i, sf::RenderWindow &window, const sf::Font &font, const sf::Text &text, int sortedIndex) {
-    int largest = i;
-    int left = 2 * i + 1;
-    int right = 2 * i + 2;
+    // As close to square as the lanes allow, below a status line
+    const float top = 30.0f;
+    size_t columns = std::ceil(std::sqrt((double)lanes.size()));
+    size_t rows = (lanes.size() + columns - 1) / columns;
+    float cellWidth = (float)WINDOW_WIDTH / columns, cellHeight = (WINDOW_HEIGHT - top) / rows;
+
+    sf::Text status;
+    status.setFont(font);
+    status.setCharacterSize(16);
+    status.setFillColor(sf::Color::White);
+    status.setPosition(10, 5);
+    sf::Text label;
+    label.setFont(font);
+    label.setCharacterSize(13);
+    sf::Sprite sprite;
+    sf::RectangleShape frame;
+    frame.setFillColor(sf::Color::Transparent);
+    frame.setOutlineThickness(-1.0f);
+    frame.setOutlineColor(sf::Color(80, 80, 80));
+    frame.setSize(sf::Vector2f(cellWidth, cellHeight));
+
+    double clock = 0.0;
+    float speed = 1.0f;
+    bool paused = false;
+    int finished = 0;
+    auto startRace = [&] {
+        for (auto &lane : lanes)
+            lane->start(input, options.sort);
+        clock = 0.0;
+        finished = 0;
+        // About twenty seconds for an n log n sort
+        speed = std::max(20.0, arraySize * std::log2((double)arraySize) / 20.0);
+    };
+    startRace();
+
+    sf::Clock frameClock;
+    while (window.isOpen()) {
+        sf::Event event;
+        while (window.pollEvent(event)) {
+            if (event.type == sf::Event::Closed)
+                window.close();
+            if (event.type == sf::Event::KeyPressed) {
+                bool newInput = false;
+                if (event.key.code == sf::Keyboard::PageUp && arraySize < MAX_ARRAY_SIZE) {
+                    arraySize = std::min(arraySize * 10, MAX_ARRAY_SIZE);
+                    newInput = true;
+                }
+                if (event.key.code == sf::Keyboard::PageDown && arraySize > MIN_ARRAY_SIZE) {
+                    arraySize = std::max(arraySize / 10, MIN_ARRAY_SIZE);
+                    newInput = true;
+                }
+                if (event.key.code == sf::Keyboard::D) {
+                    distribution = (Distribution)((distribution + 1) % std::size(DISTRIBUTIONS));
+                    newInput = true;
+                }
+                if (newInput)
+                    input = generateInput(distribution, arraySize, ++seed, maxValue);
+                // Enter runs the same input again
+                if (newInput || event.key.code == sf::Keyboard::Enter)
+                    startRace();
+                if (event.key.code == sf::Keyboard::Space)
+                    paused = !paused;
+                if (event.key.code == sf::Keyboard::Up)
+                    speed = std::min(speed * 2.0f, 1e9f);
+                if (event.key.code == sf::Keyboard::Down)
+                    speed = std::max(speed / 2.0f, 1.0f);
+            }
+        }
+
+        float seconds = frameClock.restart().asSeconds();
+        if (!paused && finished < (int)lanes.size())
+            clock += seconds * speed;
+        // Lanes that run out in the same frame are placed by the operations they needed
+        std::vector<RaceLane *> arrived;
+        for (auto &lane : lanes) {
+            if (lane->isFinished())
+                continue;
+            lane->advance(clock);
+            if (lane->isFinished())
+                arrived.push_back(lane.get());
+        }
+        std::stable_sort(arrived.begin(), arrived.end(), [](const RaceLane *a, const RaceLane *b) { return a->getFinishedAt() < b->getFinishedAt(); });
+        for (RaceLane *lane : arrived)
+            lane->setRank(++finished);
 
-    if (left < n && array[left] > array[largest])
-        largest = left;
+        std::ostringstream line;
+        line << "Race: " << arraySize << " elements, " << DISTRIBUTIONS[distribution].option << ", seed " << seed
+             << "   clock " << (std::uint64_t)clock << " ops, " << (std::uint64_t)speed << " ops/s" << (paused ? " (paused)" : "");
+        status.setString(line.str());
 
-    if (right < n && array[right] > array[largest])
-        largest = right;
+        window.clear();
+        for (size_t i = 0; i < lanes.size(); ++i) {
+            RaceLane &lane = *lanes[i];
+            lane.render(options.sort);
+            float x = (i % columns) * cellWidth, y = top + (i / columns) * cellHeight;
+            sprite.setTexture(lane.getTexture(), true);
+            sprite.setPosition(x, y);
+            sprite.setScale(cellWidth / WINDOW_WIDTH, cellHeight / WINDOW_HEIGHT);
+            countedDraw(window, sprite);
+            frame.setPosition(x, y);
+            countedDraw(window, frame);
 
-    if (largest != i) {
-        std::swap(array[i], array[largest]);
-        visualizeHeap(window, array, font, text, sortedIndex);
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        heapify(array, n, largest, window, font, text, sortedIndex);
+            const AlgorithmInfo &info = *std::find_if(std::begin(ALGORITHMS), std::end(ALGORITHMS), [&](const AlgorithmInfo &a) { return a.algorithm == lane.getAlgorithm(); });
+            std::string text = std::string(info.option) + ": " + std::to_string(lane.getOperations());
+            if (lane.isFinished())
+                text += " (#" + std::to_string(lane.getRank()) + ")";
+            label.setString(text);
+            label.setFillColor(lane.getRank() == 1 ? sf::Color::Green : lane.isFinished() ? sf::Color::Yellow : sf::Color::White);
+            label.setPosition(x + 4, y + 2);
+            countedDraw(window, label);
+        }
+        countedDraw(window, status);
+        window.display();
     }
+    return 0;
 }
 
-void heapSort(sf::RenderWindow &window, std::vector<int> &array, const sf::Font &font, const sf::Text &text) {
-    int n = array.size();
+// External sort
+// Sorts a file of native-endian 32-bit integers that may be far larger than memory. The file is
+// cut into runs that fit the memory budget, each run is sorted with one of the in-memory
+// algorithms and written to a temporary file, and then all the runs are merged in one pass.
 
-    for (int i = n / 2 - 1; i >= 0; i--)
-        heapify(array, n, i, window, font, text, n);
+// Background thread that performs file reads and writes in the order they were queued, so the
+// sort can work on one buffer while another is being filled or written out
+class IoQueue {
+public:
+    IoQueue() { thread = std::thread([this] { serve(); }); }
+    // Finishes every queued request first, since their buffers may be on the caller's stack
+    ~IoQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+    IoQueue(const IoQueue &) = delete;
+    IoQueue &operator=(const IoQueue &) = delete;
 
-    for (int i = n - 1; i > 0; i--) {
-        std::swap(array[0], array[i]);
-        visualizeHeap(window, array, font, text, i);
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        heapify(array, i, 0, window, font, text, i);
+    // Both return a ticket for wait(). The buffer must be left alone until then.
+    std::uint64_t read(std::fstream &file, void *data, size_t bytes, std::uint64_t offset) {
+        return queue({&file, (char *)data, bytes, offset, false});
+    }
+    std::uint64_t write(std::fstream &file, const void *data, size_t bytes, std::uint64_t offset) {
+        return queue({&file, (char *)data, bytes, offset, true});
     }
-}
 
-void bubbleSort(sf::RenderWindow &window, std::vector<int> &array, const sf::Font &font, const sf::Text &text) {
-    std::map<int, sf::Color> partitionColors;
-    sf::Color partitionColor = sf::Color::White;
-    for (size_t i = 0; i < array.size(); ++i) {
-        partitionColors[i] = partitionColor;
+    // Waits for the request and everything queued before it. False once any request has failed.
+    bool wait(std::uint64_t ticket) {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return completed >= ticket; });
+        return !failed;
     }
 
-    for (size_t i = 0; i < array.size() - 1; ++i) {
-        for (size_t j = 0; j < array.size() - i - 1; ++j) {
-            if (array[j] > array[j + 1]) {
-                std::swap(array[j], array[j + 1]);
-                visualizeBarsAndArray(window, array, font, text, partitionColors);
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            }
+private:
+    struct Request {
+        std::fstream *file;
+        char *data;
+        size_t bytes;
+        std::uint64_t offset;
+        bool write;
+    };
+
+    std::uint64_t queue(const Request &request) {
+        std::uint64_t ticket;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(request);
+            ticket = ++queued;
         }
+        ready.notify_one();
+        return ticket;
     }
-}
 
-int partition(std::vector<int> &array, int low, int high, sf::RenderWindow &window, const sf::Font &font, const sf::Text &text) {
-    int pivot = array[high];
-    int i = low - 1;
-    std::map<int, sf::Color> partitionColors;
-    sf::Color partitionColor = sf::Color::White;
-    for (size_t j = 0; j < array.size(); j++) {
-        partitionColors[j] = partitionColor;
+    void serve() {
+        while (true) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return closing || !requests.empty(); });
+                if (requests.empty())
+                    return;
+                request = requests.front();
+                requests.pop_front();
+            }
+            std::fstream &file = *request.file;
+            bool ok;
+            if (request.write) {
+                file.seekp(request.offset);
+                file.write(request.data, request.bytes);
+                ok = (bool)file;
+            } else {
+                file.seekg(request.offset);
+                file.read(request.data, request.bytes);
+                ok = (size_t)file.gcount() == request.bytes;
+            }
+            file.clear();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                completed++;
+                failed = failed || !ok;
+            }
+            finished.notify_all();
+        }
     }
 
-    partitionColors[high] = sf::Color::Red;
-    partitionColors[low] = sf::Color::Red;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable finished;
+    std::deque<Request> requests;
+    std::uint64_t queued = 0;
+    std::uint64_t completed = 0;
+    bool failed = false;
+    bool closing = false;
+};
 
-    for (int j = low; j <= high - 1; j++) {
-        if (array[j] < pivot) {
-            i++;
-            std::swap(array[i], array[j]);
-            visualizeBarsAndArray(window, array, font, text, partitionColors);
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+// Tournament tree for the k-way merge. Each inner node keeps the loser of the match played
+// there and nodes[0] the overall winner, so after the winner's source moves on only the
+// log2(k) matches on its path to the root are replayed. Sources are leaves k to 2k - 1.
+// Entries pack the key above the source index: one integer comparison orders them by key,
+// breaks ties by source (keeping the merge stable), and an exhausted source loses every match.
+class LoserTree {
+public:
+    explicit LoserTree(size_t sources) : leaves(sources, EXHAUSTED), nodes(std::max<size_t>(sources, 1), EXHAUSTED) {}
+
+    void set(int source, int key) { leaves[source] = entry(key, source); }
+
+    // Plays every match; call once the first key of every source is set
+    void build() {
+        int k = leaves.size();
+        std::vector<std::int64_t> winners(2 * k);
+        std::copy(leaves.begin(), leaves.end(), winners.begin() + k);
+        for (int node = k - 1; node > 0; --node) {
+            std::int64_t left = winners[2 * node], right = winners[2 * node + 1];
+            winners[node] = std::min(left, right);
+            nodes[node] = std::max(left, right);
         }
+        nodes[0] = k > 1 ? winners[1] : leaves[0];
     }
 
-    std::swap(array[i + 1], array[high]);
-    visualizeBarsAndArray(window, array, font, text, partitionColors);
-    std::this_thread::sleep_for(std::chrono::milliseconds(50));
-    return i+1;
-}
+    int winner() const { return nodes[0] & 0xffffffff; }
+    int winnerKey() const { return nodes[0] >> 32; }
+    bool empty() const { return nodes[0] == EXHAUSTED; }
 
-void quickSort(std::vector<int> &array, int low, int high, sf::RenderWindow &window, const sf::Font &font, const sf::Text &text) {
-    if (low < high) {
-        int pi = partition(array, low, high, window, font, text);
-        quickSort(array, low, pi - 1, window, font, text);
-        quickSort(array, pi + 1, high, window, font, text);
+    // The winner's source moves on to its next key, or runs out
+    void replace(int key) {
+        int source = winner();
+        replay(source, entry(key, source));
     }
-}
+    void exhaust() { replay(winner(), EXHAUSTED); }
 
+private:
+    static constexpr std::int64_t EXHAUSTED = INT64_MAX;
 
+    static std::int64_t entry(int key, int source) { return (std::int64_t)key * (std::int64_t(1) << 32) + source; }
 
-void merge(std::vector<int> &array, int left, int mid, int right, sf::RenderWindow &window, const sf::Font &font, const sf::Text &text) {
-    int n1 = mid - left + 1;
-    int n2 = right - mid;
+    void replay(int source, std::int64_t winner) {
+        // Written as selects rather than a branch, since on random keys it goes either way
+        for (size_t node = (source + leaves.size()) / 2; node > 0; node /= 2) {
+            std::int64_t loser = nodes[node];
+            bool swap = loser < winner;
+            nodes[node] = swap ? winner : loser;
+            winner = swap ? loser : winner;
+        }
+        nodes[0] = winner;
+    }
 
-    std::vector<int> L(n1), R(n2);
+    std::vector<std::int64_t> leaves;
+    std::vector<std::int64_t> nodes;
+};
 
-    for (int i = 0; i < n1; i++)
-        L[i] = array[left + i];
-    for (int i = 0; i < n2; i++)
-        R[i] = array[mid + 1 + i];
+class ExternalSorter {
+public:
+    enum Phase { IDLE, SPLITTING, MERGING, FINISHED, FAILED };
 
-    int i = 0, j = 0, k = left;
+    ~ExternalSorter() { cancel(); }
 
-    while (i < n1 && j < n2) {
-        if (L[i] <= R[j]) {
-            array[k] = L[i];
-            i++;
-        } else {
-            array[k] = R[j];
-            j++;
+    // Checks the input and plans the runs for a memory budget in bytes. Returns false (after
+    // printing why) when the files cannot be used or the budget is too small for the input.
+    bool open(const std::string &inputPath, const std::string &outputPath, size_t memoryBytes, SortAlgorithm algorithm, const SortOptions &options) {
+        cancel();
+        this->outputPath = outputPath;
+        runsPath = outputPath + ".runs";
+        this->algorithm = algorithm;
+        sortOptions = options;
+        phase = IDLE;
+        merged = 0;
+
+        input.close();
+        input.clear();
+        input.open(inputPath, std::ios::in | std::ios::binary);
+        if (!input) {
+            std::cerr << "Cannot open " << inputPath << "\n";
+            return false;
         }
-        visualizeBarsAndArrayMerge(window, array, font, text, -1, left + i, mid + 1 + j);
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
-        k++;
+        input.seekg(0, std::ios::end);
+        std::uint64_t bytes = input.tellg();
+        if (bytes % sizeof(int) != 0) {
+            std::cerr << inputPath << " is not a whole number of 32-bit integers\n";
+            return false;
+        }
+        elements = bytes / sizeof(int);
+
+        // Two run buffers, so one is read while the other is sorted, plus the same again for
+        // algorithms that need scratch space
+        runElements = std::max<size_t>(1, memoryBytes / sizeof(int) / 3);
+        runCount = (elements + runElements - 1) / runElements;
+        // The merge double-buffers every run and the output
+        blockElements = memoryBytes / sizeof(int) / (2 * runCount + 2);
+        if (runCount > 1 && blockElements < MIN_BLOCK) {
+            std::cerr << "Merging " << runCount << " runs needs more memory than " << (memoryBytes >> 20) << " MB\n";
+            return false;
+        }
+
+        runs = std::make_unique<Run[]>(runCount);
+        for (size_t i = 0; i < runCount; ++i) {
+            runs[i].length = std::min<std::uint64_t>(runElements, elements - i * runElements);
+            runs[i].sorted = false;
+            runs[i].consumed = 0;
+        }
+        return true;
     }
 
-    while (i < n1) {
-        array[k] = L[i];
-        visualizeBarsAndArrayMerge(window, array, font, text, -1, left + i, -1);
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
-        i++;
-        k++;
+    // Sorts on this thread; start() does the same on a background one
+    bool sort() {
+        auto start = std::chrono::steady_clock::now();
+        phase = SPLITTING;
+        bool ok = split();
+        splitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (ok && runCount > 1) {
+            phase = MERGING;
+            ok = merge();
+        }
+        totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (runCount > 1)
+            std::remove(runsPath.c_str());
+        phase.store(ok ? FINISHED : FAILED, std::memory_order_release);
+        return ok;
     }
 
-    while (j < n2) {
-        array[k] = R[j];
-        visualizeBarsAndArrayMerge(window, array, font, text, -1, -1, mid + 1 + j);
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
-        j++;
-        k++;
+    void start() {
+        cancel();
+        cancelled = false;
+        thread = std::thread([this] { sort(); });
     }
-}
 
-void mergeSort(std::vector<int> &array, int left, int right, sf::RenderWindow &window, const sf::Font &font, const sf::Text &text) {
-    if (left < right) {
-        int mid = left + (right - left) / 2;
+    // Stops the sort (if any) and waits for its thread to exit
+    void cancel() {
+        if (thread.joinable()) {
+            cancelled = true;
+            thread.join();
+        }
+    }
+
+    Phase getPhase() const { return phase.load(std::memory_order_acquire); }
+    std::uint64_t getElements() const { return elements; }
+    size_t getRunCount() const { return runCount; }
+    size_t getRunElements() const { return runElements; }
+    std::uint64_t getRunLength(size_t run) const { return runs[run].length; }
+    bool isRunSorted(size_t run) const { return runs[run].sorted.load(std::memory_order_relaxed); }
+    std::uint64_t getConsumed(size_t run) const { return runs[run].consumed.load(std::memory_order_relaxed); }
+    std::uint64_t getMerged() const { return merged.load(std::memory_order_relaxed); }
+    // Valid once the phase is FINISHED
+    double getSplitSeconds() const { return splitSeconds; }
+    double getTotalSeconds() const { return totalSeconds; }
+
+private:
+    static const size_t MIN_BLOCK = 16384; // 64 KB, below which the merge is bound by seeks
 
-        mergeSort(array, left, mid, window, font, text);
-        mergeSort(array, mid + 1, right, window, font, text);
-        merge(array, left, mid, right, window, font, text);
+    struct Run {
+        std::uint64_t length;
+        std::atomic<bool> sorted;
+        std::atomic<std::uint64_t> consumed; // elements the merge has taken from it
+    };
+
+    // Reads run r + 1 while run r is sorted and run r - 1 is written out. With a single run
+    // it goes straight to the output file.
+    bool split() {
+        std::fstream runsFile(runCount > 1 ? runsPath : outputPath, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!runsFile) {
+            std::cerr << "Cannot create " << (runCount > 1 ? runsPath : outputPath) << "\n";
+            return false;
+        }
+        std::vector<int> buffers[2];
+        std::uint64_t reads[2] = {0, 0};
+        IoQueue io;
+        auto queueRead = [&](size_t run) {
+            std::vector<int> &buffer = buffers[run % 2];
+            // Only shrinks after the first use, so a write still queued from it is not disturbed
+            buffer.resize(runs[run].length);
+            reads[run % 2] = io.read(input, buffer.data(), buffer.size() * sizeof(int), run * runElements * sizeof(int));
+        };
+
+        if (runCount > 0)
+            queueRead(0);
+        std::uint64_t written = 0;
+        for (size_t run = 0; run < runCount; ++run) {
+            if (!io.wait(reads[run % 2])) {
+                std::cerr << "Cannot read the input\n";
+                return false;
+            }
+            if (cancelled)
+                return false;
+            if (run + 1 < runCount)
+                queueRead(run + 1);
+
+            std::vector<int> &buffer = buffers[run % 2];
+            if (!sortRange(algorithm, buffer.begin(), buffer.end(), std::less<>(), Identity(), sortOptions)) {
+                StepTrace trace(false);
+                runAlgorithm(algorithm, buffer, trace, sortOptions);
+            }
+            written = io.write(runsFile, buffer.data(), buffer.size() * sizeof(int), run * runElements * sizeof(int));
+            runs[run].sorted = true;
+        }
+        if (!io.wait(written)) {
+            std::cerr << "Cannot write " << (runCount > 1 ? runsPath : outputPath) << "\n";
+            return false;
+        }
+        merged = runCount <= 1 ? elements : 0;
+        return true;
     }
-}
 
+    // Merges every run at once through a loser tree. Each run has two blocks: one is being
+    // merged while the next part of the run is read into the other.
+    bool merge() {
+        std::fstream runsFile(runsPath, std::ios::in | std::ios::binary);
+        std::fstream output(outputPath, std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!runsFile || !output) {
+            std::cerr << "Cannot open " << (runsFile ? outputPath : runsPath) << "\n";
+            return false;
+        }
 
+        struct Source {
+            std::vector<int> blocks[2];
+            size_t filled[2] = {0, 0};
+            std::uint64_t tickets[2] = {0, 0};
+            int active = 0;
+            size_t position = 0;
+            std::uint64_t next; // next element of the runs file to read
+            std::uint64_t end;
+        };
+        std::vector<Source> sources(runCount);
+        std::vector<int> outputBlocks[2];
+        std::uint64_t outputTickets[2] = {0, 0};
+        IoQueue io;
+        auto failed = [&] {
+            if (!cancelled)
+                std::cerr << "Cannot read " << runsPath << " or write " << outputPath << "\n";
+            return false;
+        };
 
-void selectionSort(sf::RenderWindow &window, std::vector<int> &array, const sf::Font &font, const sf::Text &text) {
-    int n = array.size();
-    std::map<int, sf::Color> partitionColors;
+        auto queueRead = [&](Source &source, int block) {
+            size_t count = std::min<std::uint64_t>(blockElements, source.end - source.next);
+            source.filled[block] = count;
+            if (count > 0)
+                source.tickets[block] = io.read(runsFile, source.blocks[block].data(), count * sizeof(int), source.next * sizeof(int));
+            source.next += count;
+        };
 
-    for (int i = 0; i < n - 1; i++) {
-        int minIndex = i;
-        for (int j = i + 1; j < n; j++) {
-            if (array[j] < array[minIndex]) {
-                minIndex = j;
+        LoserTree tree(runCount);
+        for (size_t i = 0; i < runCount; ++i) {
+            Source &source = sources[i];
+            source.next = i * runElements;
+            source.end = source.next + runs[i].length;
+            for (int block = 0; block < 2; ++block) {
+                source.blocks[block].resize(blockElements);
+                queueRead(source, block);
             }
         }
-        std::swap(array[minIndex], array[i]);
-        sf::Color partitionColor = sf::Color::White;
-        for (size_t j = 0; j < array.size(); j++) {
-        partitionColors[j] = partitionColor;
+        for (size_t i = 0; i < runCount; ++i) {
+            if (!io.wait(sources[i].tickets[0]))
+                return failed();
+            tree.set(i, sources[i].blocks[0][0]);
+        }
+        tree.build();
+
+        for (std::vector<int> &block : outputBlocks)
+            block.resize(blockElements);
+        int outputActive = 0;
+        size_t outputFilled = 0;
+        std::uint64_t outputOffset = 0;
+        auto flush = [&] {
+            outputTickets[outputActive] = io.write(output, outputBlocks[outputActive].data(), outputFilled * sizeof(int), outputOffset * sizeof(int));
+            outputOffset += outputFilled;
+            merged.store(outputOffset, std::memory_order_relaxed);
+            outputActive ^= 1;
+            outputFilled = 0;
+            return io.wait(outputTickets[outputActive]);
+        };
+
+        while (!tree.empty()) {
+            int winner = tree.winner();
+            int *out = outputBlocks[outputActive].data();
+            out[outputFilled++] = tree.winnerKey();
+            if (outputFilled == blockElements && (!flush() || cancelled))
+                return failed();
+
+            Source &source = sources[winner];
+            if (++source.position < source.filled[source.active]) {
+                tree.replace(source.blocks[source.active][source.position]);
+            } else {
+                // The block is used up: refill it with the part of the run after the other one
+                runs[winner].consumed.fetch_add(source.filled[source.active], std::memory_order_relaxed);
+                queueRead(source, source.active);
+                source.active ^= 1;
+                source.position = 0;
+                if (source.filled[source.active] == 0) {
+                    tree.exhaust();
+                } else {
+                    if (!io.wait(source.tickets[source.active]) || cancelled)
+                        return failed();
+                    tree.replace(source.blocks[source.active][0]);
+                }
+            }
+        }
+        if (outputFilled > 0 && !flush())
+            return failed();
+        if (!io.wait(outputTickets[outputActive ^ 1]))
+            return failed();
+        return true;
     }
-        partitionColors[minIndex] = sf::Color::Red;
 
-        visualizeBarsAndArray(window, array, font, text,partitionColors);
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::fstream input;
+    std::string outputPath;
+    std::string runsPath;
+    SortAlgorithm algorithm = INTRO_SORT;
+    SortOptions sortOptions;
+    std::uint64_t elements = 0;
+    size_t runElements = 0;
+    size_t runCount = 0;
+    size_t blockElements = 0;
+    std::unique_ptr<Run[]> runs;
+
+    std::thread thread;
+    std::atomic<bool> cancelled{false};
+    std::atomic<Phase> phase{IDLE};
+    std::atomic<std::uint64_t> merged{0};
+    double splitSeconds = 0.0;
+    double totalSeconds = 0.0;
+};
+
+// One line on where an external sort is, for the window title and the terminal
+std::string describeExternalSort(const ExternalSorter &sorter) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    double megabytes = sorter.getElements() * sizeof(int) / 1048576.0;
+    switch (sorter.getPhase()) {
+    case ExternalSorter::SPLITTING: {
+        size_t sorted = 0;
+        for (size_t run = 0; run < sorter.getRunCount(); ++run)
+            sorted += sorter.isRunSorted(run);
+        out << "Sorting runs: " << sorted << " of " << sorter.getRunCount();
+        break;
     }
+    case ExternalSorter::MERGING:
+        out << "Merging " << sorter.getRunCount() << " runs: " << 100.0 * sorter.getMerged() / sorter.getElements() << "%";
+        break;
+    case ExternalSorter::FINISHED:
+        out << "Sorted " << megabytes << " MB in " << sorter.getTotalSeconds() << " s (runs " << sorter.getSplitSeconds()
+            << " s), " << megabytes / std::max(sorter.getTotalSeconds(), 1e-9) << " MB/s";
+        break;
+    case ExternalSorter::FAILED:
+        out << "The sort failed";
+        break;
+    default:
+        out << "Waiting";
+    }
+    return out.str();
 }
 
+// Run-level view: a bar per run, grey until the run is sorted and then white, shrinking from
+// the top as the merge takes its elements, and a green bar on the right for the output
+void visualizeExternalSort(sf::RenderTarget &target, sf::VertexArray &vertices, const ExternalSorter &sorter, const sf::Text &text) {
+    const float baseline = WINDOW_HEIGHT - 80.0f, maxHeight = WINDOW_HEIGHT - 200.0f;
+    size_t columns = sorter.getRunCount() + 1;
+    float slotWidth = std::min(40.0f, (WINDOW_WIDTH - 40.0f) / columns);
+    float spacing = slotWidth >= 4.0f ? slotWidth / 5.0f : 0.0f;
+    float startX = (WINDOW_WIDTH - columns * slotWidth + spacing) / 2;
+    bool merging = sorter.getPhase() == ExternalSorter::MERGING || sorter.getPhase() == ExternalSorter::FINISHED;
 
-sf::Color generateRandomColor() {
-    int r = rand() % 256;
-    int g = rand() % 256;
-    int b = rand() % 256;
-    return sf::Color(r, g, b);
+    vertices.setPrimitiveType(sf::Quads);
+    vertices.clear();
+    auto addBar = [&](size_t column, float bottom, float height, sf::Color color) {
+        float left = startX + column * slotWidth, right = left + slotWidth - spacing;
+        vertices.append(sf::Vertex(sf::Vector2f(left, bottom - height), color));
+        vertices.append(sf::Vertex(sf::Vector2f(right, bottom - height), color));
+        vertices.append(sf::Vertex(sf::Vector2f(right, bottom), color));
+        vertices.append(sf::Vertex(sf::Vector2f(left, bottom), color));
+    };
+    float runScale = maxHeight / std::max<size_t>(sorter.getRunElements(), 1);
+    for (size_t run = 0; run < sorter.getRunCount(); ++run) {
+        float height = sorter.getRunLength(run) * runScale;
+        addBar(run, baseline, height, sf::Color(60, 60, 60));
+        if (merging)
+            addBar(run, baseline, (sorter.getRunLength(run) - sorter.getConsumed(run)) * runScale, sf::Color::White);
+        else if (sorter.isRunSorted(run))
+            addBar(run, baseline, height, sf::Color::White);
+    }
+    float outputHeight = sorter.getElements() > 0 ? maxHeight * sorter.getMerged() / sorter.getElements() : maxHeight;
+    addBar(columns - 1, baseline, maxHeight, sf::Color(30, 70, 30));
+    addBar(columns - 1, baseline, outputHeight, sf::Color::Green);
+
+    target.clear();
+    countedDraw(target, vertices);
+    countedDraw(target, text);
 }
 
+int runExternalSort(const CommandLineOptions &options) {
+    std::string output = options.externalOutput.empty() ? options.externalInput + ".sorted" : options.externalOutput;
+    ExternalSorter sorter;
+    if (!sorter.open(options.externalInput, output, options.memory << 20, options.externalAlgorithm, options.sort))
+        return 1;
+    std::ostringstream title;
+    title << "External sort: " << sorter.getElements() << " integers, " << sorter.getRunCount() << " runs of up to "
+          << sorter.getRunElements() << "\n";
+    sorter.start();
+
+    // With --bench there is no window, only a progress line every few seconds
+    if (options.benchmark) {
+        std::cerr << title.str();
+        auto reported = std::chrono::steady_clock::now();
+        while (sorter.getPhase() != ExternalSorter::FINISHED && sorter.getPhase() != ExternalSorter::FAILED) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if (std::chrono::steady_clock::now() - reported >= std::chrono::seconds(5)) {
+                std::cerr << describeExternalSort(sorter) << "\n";
+                reported = std::chrono::steady_clock::now();
+            }
+        }
+        std::cerr << describeExternalSort(sorter) << "\n";
+        return sorter.getPhase() == ExternalSorter::FINISHED ? 0 : 1;
+    }
+
+    sf::RenderWindow window(sf::VideoMode(WINDOW_WIDTH, WINDOW_HEIGHT), "Algorithm Visualizer");
+    window.setFramerateLimit(60);
+    sf::Font font;
+    if (!font.loadFromFile("arial.ttf")) {
+        return -1;
+    }
+    sf::Text text;
+    text.setFont(font);
+    text.setCharacterSize(24);
+    text.setFillColor(sf::Color::White);
+    text.setPosition(10, 10);
+    sf::VertexArray vertices;
+
+    while (window.isOpen()) {
+        sf::Event event;
+        while (window.pollEvent(event)) {
+            if (event.type == sf::Event::Closed) {
+                sorter.cancel();
+                window.close();
+            }
+        }
+        text.setString(title.str() + describeExternalSort(sorter));
+        visualizeExternalSort(window, vertices, sorter, text);
+        window.display();
+    }
+    return sorter.getPhase() == ExternalSorter::FINISHED ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    CommandLineOptions options;
+    if (!parseCommandLine(argc, argv, options))
+        return 1;
+    if (options.help) {
+        printUsage(argv[0]);
+        return 0;
+    }
+    if (!options.externalInput.empty())
+        return runExternalSort(options);
+    if (options.benchmark)
+        return runBenchmark(options);
+    if (options.saveTrace)
+        return runSaveTrace(options);
+    if (!options.exportPath.empty())
+        return runExport(options);
+    if (options.race)
+        return runRace(options);
 
-int main() {
     sf::RenderWindow window(sf::VideoMode(WINDOW_WIDTH, WINDOW_HEIGHT), "Algorithm Visualizer");
+    window.setFramerateLimit(60);
 
-    std::vector<int> array(20);
-    std::srand(std::time(0)); // Initialize random seed
-    std::generate(array.begin(), array.end(), []() { return rand() % 100; });
+    // Every new array uses the next seed, so a whole session can be replayed with --seed
+    std::uint64_t seed = options.hasSeed ? options.seed : std::time(0);
+    size_t arraySize = options.size;
+    Distribution distribution = options.distribution;
+    int maxValue = options.maxValue > 0 ? options.maxValue : 199;
+    std::vector<int> array = generateInput(distribution, arraySize, seed, maxValue);
 
     SortAlgorithm currentAlgorithm = BUBBLE_SORT;
-    bool isSorting = false;
-    sf::Color partitionColor;
+    TracePlayer player;
+    player.load(array, StepTrace());
+    SortWorker worker;
+
+    // Trace file being written with S. It takes the player's steps as they stream in and is
+    // finished once the sort is; anything that replaces the player's trace first removes it.
+    std::unique_ptr<TraceWriter> save;
+    auto stopSaving = [&] {
+        if (save) {
+            std::cerr << "Stopped saving to " << options.traceFile << "\n";
+            save.reset();
+        }
+    };
 
     // Load font
     sf::Font font;
@@ -429,103 +5664,226 @@ int main() {
     text.setCharacterSize(24);
     text.setFillColor(sf::Color::White);
     text.setPosition(10, 10);
-    text.setString("Current Algorithm: Bubble Sort");
+    setTitle(text, currentAlgorithm, arraySize, distribution, seed, options.sort);
+
+    BarRenderer bars(400, 320);
+    LabelLayer labels(font, WINDOW_HEIGHT - 100.0f);
+    HeapRenderer heap(font, 85.0f, WINDOW_HEIGHT - 110.0f);
+    HighlightBuffer highlights;
+
+    Instrumentation instrumentation;
+    bool showInstrumentation = false;
+    sf::Text overlay;
+    overlay.setFont(font);
+    overlay.setCharacterSize(13);
+    overlay.setFillColor(sf::Color::Yellow);
+    overlay.setPosition(WINDOW_WIDTH - 240, 10);
 
+    sf::Clock frameClock;
     while (window.isOpen()) {
         sf::Event event;
         while (window.pollEvent(event)) {
-            if (event.type == sf::Event::Closed)
+            if (event.type == sf::Event::Closed) {
+                worker.cancel();
                 window.close();
+            }
             if (event.type == sf::Event::KeyPressed) {
+                bool selected = false;
                 if (event.key.code == sf::Keyboard::Num1) {
                     currentAlgorithm = BUBBLE_SORT;
-                    text.setString("Current Algorithm: Bubble Sort");
-                    std::generate(array.begin(), array.end(), []() { return rand() % 200; });
-                    isSorting = false;
+                    selected = true;
                 }
                 if (event.key.code == sf::Keyboard::Num2) {
                     currentAlgorithm = HEAP_SORT;
-                    text.setString("Current Algorithm: Heap Sort");
-                    std::generate(array.begin(), array.end(), []() { return rand() % 200; });
-                    isSorting = false;
+                    selected = true;
                 }
                 if (event.key.code == sf::Keyboard::Num3) {
                     currentAlgorithm = QUICK_SORT;
-                    text.setString("Current Algorithm: Quick Sort");
-                    std::generate(array.begin(), array.end(), []() { return rand() % 200; });
-                    isSorting = false;
+                    selected = true;
                 }
 
                 if (event.key.code == sf::Keyboard::Num4) {
                     currentAlgorithm = MERGE_SORT;
-                    text.setString("Current Algorithm: Merge Sort");
-                    std::generate(array.begin(), array.end(), []() { return rand() % 200; });
-                    isSorting = false;
+                    selected = true;
                 }
 
                 if (event.key.code == sf::Keyboard::Num5) {
                     currentAlgorithm = SELECTION_SORT;
-                    text.setString("Current Algorithm: Selection Sort");
-                    std::generate(array.begin(), array.end(), []() { return rand() % 200; });
-                    isSorting = false;
+                    selected = true;
+                }
+
+                if (event.key.code == sf::Keyboard::Num6) {
+                    currentAlgorithm = PARALLEL_MERGE_SORT;
+                    selected = true;
+                }
+
+                if (event.key.code == sf::Keyboard::Num7) {
+                    currentAlgorithm = PARALLEL_QUICK_SORT;
+                    selected = true;
+                }
+
+                if (event.key.code == sf::Keyboard::Num8) {
+                    currentAlgorithm = BOTTOM_UP_MERGE_SORT;
+                    selected = true;
+                }
+
+                if (event.key.code == sf::Keyboard::Num9) {
+                    currentAlgorithm = INTRO_SORT;
+                    selected = true;
+                }
+
+                if (event.key.code == sf::Keyboard::Num0) {
+                    currentAlgorithm = RADIX_SORT_LSD_8;
+                    selected = true;
+                }
+
+                // Save the sort to the trace file, or replay one without sorting again
+                if (event.key.code == sf::Keyboard::S) {
+                    if (player.isFromFile()) {
+                        std::cerr << "This sort was loaded from a trace file already\n";
+                    } else if (save) {
+                        std::cerr << "Already saving to " << options.traceFile << "\n";
+                    } else {
+                        TraceHeader header{};
+                        header.algorithm = currentAlgorithm;
+                        header.seed = seed;
+                        header.distribution = distribution;
+                        header.heapArity = options.sort.heapArity;
+                        header.bottomUpHeap = options.sort.bottomUpHeap;
+                        header.networkBlock = options.sort.networkBlock;
+                        save = std::make_unique<TraceWriter>();
+                        if (!save->open(options.traceFile, header, player.getInitial()))
+                            save.reset();
+                    }
+                }
+                if (event.key.code == sf::Keyboard::L) {
+                    auto file = std::make_unique<TraceFile>();
+                    if (file->open(options.traceFile)) {
+                        const TraceHeader &header = file->getHeader();
+                        if (header.algorithm >= std::size(ALGORITHMS) || header.distribution >= std::size(DISTRIBUTIONS) || header.arraySize > MAX_ARRAY_SIZE) {
+                            std::cerr << options.traceFile << " was saved by a different version\n";
+                        } else {
+                            worker.cancel();
+                            stopSaving();
+                            currentAlgorithm = (SortAlgorithm)header.algorithm;
+                            seed = header.seed;
+                            distribution = (Distribution)header.distribution;
+                            arraySize = header.arraySize;
+                            options.sort.heapArity = header.heapArity == 4 || header.heapArity == 8 ? header.heapArity : 2;
+                            options.sort.bottomUpHeap = header.bottomUpHeap != 0;
+                            int block = header.networkBlock;
+                            options.sort.networkBlock = block == 8 || block == 16 || block == 32 || block == 64 ? block : 0;
+                            player.load(std::move(file));
+                            setTitle(text, currentAlgorithm, arraySize, distribution, seed, options.sort);
+                        }
+                    }
+                }
+
+                // Tab walks through every algorithm, including the ones without a number key
+                if (event.key.code == sf::Keyboard::Tab) {
+                    currentAlgorithm = (SortAlgorithm)((currentAlgorithm + 1) % std::size(ALGORITHMS));
+                    selected = true;
+                }
+
+                // Array size and input distribution
+                if (event.key.code == sf::Keyboard::PageUp && arraySize < MAX_ARRAY_SIZE) {
+                    arraySize = std::min(arraySize * 10, MAX_ARRAY_SIZE);
+                    selected = true;
+                }
+                if (event.key.code == sf::Keyboard::PageDown && arraySize > MIN_ARRAY_SIZE) {
+                    arraySize = std::max(arraySize / 10, MIN_ARRAY_SIZE);
+                    selected = true;
+                }
+                if (event.key.code == sf::Keyboard::D) {
+                    distribution = (Distribution)((distribution + 1) % std::size(DISTRIBUTIONS));
+                    selected = true;
+                }
+
+                // Heap sort variants: 2, 4 or 8 children per node, and Floyd's bottom-up sift
+                if (event.key.code == sf::Keyboard::A) {
+                    options.sort.heapArity = options.sort.heapArity == 8 ? 2 : options.sort.heapArity * 2;
+                    selected = true;
+                }
+                if (event.key.code == sf::Keyboard::F) {
+                    options.sort.bottomUpHeap = !options.sort.bottomUpHeap;
+                    selected = true;
                 }
 
+                // Sorting network base case: off, 8, 16, 32, 64
+                if (event.key.code == sf::Keyboard::N) {
+                    options.sort.networkBlock = options.sort.networkBlock == 0 ? 8 : options.sort.networkBlock == 64 ? 0 : options.sort.networkBlock * 2;
+                    selected = true;
+                }
+
+                if (selected) {
+                    worker.cancel();
+                    stopSaving();
+                    array = generateInput(distribution, arraySize, ++seed, maxValue);
+                    player.load(array, StepTrace());
+                    setTitle(text, currentAlgorithm, arraySize, distribution, seed, options.sort);
+                }
 
+                // Sort on the worker thread; the player receives the steps as they are recorded
                 if (event.key.code == sf::Keyboard::Enter) {
-                    isSorting = true;
+                    std::vector<int> initial = player.getArray();
+                    worker.cancel();
+                    stopSaving();
+                    player.load(initial, StepTrace());
+                    worker.start(currentAlgorithm, initial, options.sort);
                 }
+                if (event.key.code == sf::Keyboard::P)
+                    worker.togglePause();
+                if (event.key.code == sf::Keyboard::Escape)
+                    worker.cancel();
+
+                // Playback controls
+                if (event.key.code == sf::Keyboard::Space)
+                    player.togglePause();
+                if (event.key.code == sf::Keyboard::Up)
+                    player.faster();
+                if (event.key.code == sf::Keyboard::Down)
+                    player.slower();
+                if (event.key.code == sf::Keyboard::Right)
+                    player.seek(player.getPosition() + 1);
+                if (event.key.code == sf::Keyboard::Left)
+                    player.seek(player.getPosition() > 0 ? player.getPosition() - 1 : 0);
+                if (event.key.code == sf::Keyboard::Home)
+                    player.seek(0);
+                if (event.key.code == sf::Keyboard::End)
+                    player.seek(player.getLength());
+
+                // Instrumentation overlay, and appending it to the stats file
+                if (event.key.code == sf::Keyboard::I)
+                    showInstrumentation = !showInstrumentation;
+                if (event.key.code == sf::Keyboard::O && instrumentation.dump(options.statsFile, text.getString().toAnsiString(), worker))
+                    std::cerr << "Instrumentation appended to " << options.statsFile << "\n";
             }
         }
 
-        if (isSorting) {
-            if (currentAlgorithm == BUBBLE_SORT) {
-                bubbleSort(window, array, font, text);
-            } else if (currentAlgorithm == HEAP_SORT) {
-                heapSort(window, array, font, text);
-            } else if (currentAlgorithm == QUICK_SORT) {
-                quickSort(array, 0, array.size() - 1, window, font, text);
-            } else if (currentAlgorithm == MERGE_SORT) {
-                mergeSort(array, 0, array.size() - 1, window, font, text);
-            }  else if (currentAlgorithm == SELECTION_SORT) {
-                selectionSort(window, array, font, text);
+        bool sorting = worker.isRunning();
+        size_t buffered = player.getLength() - player.getPosition();
+        if (buffered < PLAYBACK_LOOKAHEAD)
+            worker.drain(player, PLAYBACK_LOOKAHEAD - buffered);
+        if (save) {
+            // Once the sort is done, the rest of it is only waiting in the worker's queue
+            if (!sorting)
+                worker.drain(player, SIZE_MAX);
+            for (size_t i = save->size(); i < player.getLength(); ++i)
+                save->append(player.getTrace()[i]);
+            if (!sorting) {
+                size_t steps = save->size();
+                if (save->finish())
+                    std::cerr << "Saved " << steps << " steps to " << options.traceFile << "\n";
+                save.reset();
             }
-
-            isSorting = false;
         }
-
-        window.clear();
-        if (currentAlgorithm == BUBBLE_SORT) {
-            std::map<int, sf::Color> partitionColors;
-            sf::Color partitionColor = sf::Color::White;
-            for (size_t i = 0; i < array.size(); ++i) {
-                partitionColors[i] = partitionColor;
-            }
-            visualizeBarsAndArray(window, array, font, text, partitionColors);
-        } else if (currentAlgorithm == HEAP_SORT) {
-            visualizeHeap(window, array, font, text, array.size());
-        } else if (currentAlgorithm == QUICK_SORT) {
-            std::map<int, sf::Color> partitionColors;
-            sf::Color partitionColor = sf::Color::White;
-            for (size_t i = 0; i < array.size(); ++i) {
-                partitionColors[i] = partitionColor;
-            }
-            visualizeBarsAndArray(window, array, font, text, partitionColors);
-        } else if (currentAlgorithm == MERGE_SORT) {
-            std::map<int, sf::Color> partitionColors;
-            sf::Color partitionColor = sf::Color::White;
-            for (size_t i = 0; i < array.size(); ++i) {
-                partitionColors[i] = partitionColor;
-            }
-            visualizeBarsAndArray(window, array, font, text, partitionColors);
-        } else if (currentAlgorithm == SELECTION_SORT) {
-            std::map<int, sf::Color> partitionColors;
-            sf::Color partitionColor = sf::Color::White;
-            for (size_t i = 0; i < array.size(); ++i) {
-                partitionColors[i] = partitionColor;
-            }
-            visualizeBarsAndArray(window, array, font, text, partitionColors);
-        }
-        window.draw(text);
+        player.update(frameClock.restart().asSeconds());
+        instrumentation.beginFrame();
+        renderPlayer(window, bars, labels, heap, highlights, player, currentAlgorithm, options.sort, text);
+        if (showInstrumentation)
+            countedDraw(window, overlay);
+        if (instrumentation.endFrame() && showInstrumentation)
+            overlay.setString(instrumentation.report(worker));
         window.display();
     }
 